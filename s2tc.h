@@ -0,0 +1,223 @@
+/*
+ * Copyright (C) 2011  Rudolf Polzer   All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * RUDOLF POLZER BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN
+ * AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef S2TC_H
+#define S2TC_H
+
+/* S2TC compression API with explicit settings and reusable state */
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum
+{
+	S2TC_FORMAT_DXT1,
+	S2TC_FORMAT_DXT3,
+	S2TC_FORMAT_DXT5
+} s2tc_format_t;
+
+/* channel order of the source pixels, 8 bits each */
+typedef enum
+{
+	S2TC_LAYOUT_RGBA,
+	S2TC_LAYOUT_BGRA,
+	S2TC_LAYOUT_RGB,
+	S2TC_LAYOUT_BGR,
+	S2TC_LAYOUT_L, /* luminance, encoded as gray */
+	S2TC_LAYOUT_LA /* luminance-alpha */
+} s2tc_layout_t;
+
+/* same meaning as the values of S2TC_COMPRESSION_MODE; REALTIME ignores the color, refinement and dither settings */
+typedef enum
+{
+	S2TC_MODE_NORMAL,
+	S2TC_MODE_REALTIME
+} s2tc_compression_mode_t;
+
+/* same meaning as the values of S2TC_COLORDIST_MODE */
+typedef enum
+{
+	S2TC_COLORDIST_RGB,
+	S2TC_COLORDIST_YUV,
+	S2TC_COLORDIST_SRGB,
+	S2TC_COLORDIST_SRGB_MIXED,
+	S2TC_COLORDIST_AVG,
+	S2TC_COLORDIST_WAVG,
+	S2TC_COLORDIST_W0AVG,
+	S2TC_COLORDIST_NORMALMAP
+} s2tc_colordist_mode_t;
+
+typedef enum
+{
+	S2TC_REFINE_NEVER,
+	S2TC_REFINE_ALWAYS,
+	S2TC_REFINE_LOOP
+} s2tc_refine_mode_t;
+
+typedef enum
+{
+	S2TC_DITHER_NONE,
+	S2TC_DITHER_SIMPLE,
+	S2TC_DITHER_FLOYDSTEINBERG
+} s2tc_dither_mode_t;
+
+typedef struct
+{
+	s2tc_compression_mode_t mode;
+	s2tc_colordist_mode_t colordist;
+	int random_colors; /* like S2TC_RANDOM_COLORS: -1 quick, 0 all input colors, >0 extra random colors */
+	s2tc_refine_mode_t refine;
+	s2tc_dither_mode_t dither;
+	int neighbor_seeds; /* nonzero: the endpoints of the left and upper neighbor blocks are extra candidates (random_colors > 0 only) */
+	int temporal; /* nonzero: blocks whose source pixels are unchanged since the last call of the same size and format are copied, the others seeded from it; the source is compared before dithering, so with DITHER_SIMPLE a copied block may differ slightly from a fresh encode near changed ones */
+	int threads; /* worker threads for s2tc_compress; 0 means one per CPU, 1 compresses in the calling thread */
+} s2tc_config_t;
+
+typedef struct s2tc_context_s s2tc_context_t;
+
+/* fills in the defaults (the same as tx_compress_dxtn without environment variables) */
+void s2tc_config_init(s2tc_config_t *config);
+/* overrides the settings with the S2TC_* environment variables that are set */
+void s2tc_config_from_env(s2tc_config_t *config);
+
+/* config NULL means defaults plus environment variables; returns NULL on failure */
+s2tc_context_t *s2tc_context_create(const s2tc_config_t *config);
+void s2tc_context_destroy(s2tc_context_t *ctx);
+
+/* compresses width*height pixels (L, LA, RGB or RGBA for srccomps 1 to 4) at src (packed) to format (dest, dstRowStride)
+ * a context may be shared between threads; concurrent calls on it are safe but don't share its scratch memory or threads
+ * returns 0 on success, -1 on bad arguments or out of memory */
+int s2tc_compress(s2tc_context_t *ctx, int srccomps, int width, int height,
+		  const unsigned char *src, s2tc_format_t format,
+		  unsigned char *dest, int dstRowStride);
+/* like s2tc_compress, but reads the source in place: srcRowStride bytes per row, channels in the given layout */
+int s2tc_compress_image(s2tc_context_t *ctx, int width, int height,
+			const unsigned char *src, int srcRowStride, s2tc_layout_t layout,
+			s2tc_format_t format, unsigned char *dest, int dstRowStride);
+/* like s2tc_compress_image, for the next level of a mip chain: parent is the previous level
+ * (parentWidth*parentHeight pixels, at most twice as large plus one in each direction) as encoded in the
+ * same format, with parentRowStride bytes per block row; the colors of its blocks are candidates
+ * for the blocks covering the same area (random_colors > 0 only); parent NULL is s2tc_compress_image */
+int s2tc_compress_mip(s2tc_context_t *ctx, int width, int height,
+		      const unsigned char *src, int srcRowStride, s2tc_layout_t layout,
+		      s2tc_format_t format, unsigned char *dest, int dstRowStride,
+		      const unsigned char *parent, int parentWidth, int parentHeight, int parentRowStride);
+/* compresses the rectangle (x, y, width, height) of an image of imageWidth*imageHeight pixels at src
+ * (srcRowStride bytes per row, channels in layout) into the matching blocks of dest, which holds the
+ * whole image in format with dstRowStride bytes per block row; the other blocks are left alone
+ * x and y must be multiples of 4, and so must width and height unless the rectangle ends at the image border
+ * dithering starts anew at the rectangle, so its blocks only depend on the pixels inside it
+ * the temporal warm start state of the context is neither used nor changed */
+int s2tc_compress_rect(s2tc_context_t *ctx, int imageWidth, int imageHeight,
+		       const unsigned char *src, int srcRowStride, s2tc_layout_t layout,
+		       int x, int y, int width, int height,
+		       s2tc_format_t format, unsigned char *dest, int dstRowStride);
+/* one image of a batch, with the arguments of s2tc_compress_image */
+typedef struct
+{
+	int width, height;
+	const unsigned char *src;
+	int srcRowStride;
+	s2tc_layout_t layout;
+	s2tc_format_t format;
+	unsigned char *dest;
+	int dstRowStride;
+} s2tc_image_t;
+
+/* compresses count images, spread over the worker threads of the context (one image per thread at a time);
+ * meant for many small images such as mip tails, icons or glyphs
+ * returns 0 if all images were compressed, -1 if any of them failed */
+int s2tc_compress_batch(s2tc_context_t *ctx, const s2tc_image_t *images, int count);
+
+/* asynchronous compression: a job compresses one image like s2tc_compress_image on a thread of the
+ * context; src must stay valid and dest untouched until the job is finished or cancelled */
+typedef struct s2tc_job_s s2tc_job_t;
+/* called on the context's thread when a job has run, with the s2tc_compress_image return value
+ * the callback may release its own job, which is then freed once the callback returns, but must not
+ * wait for it: the job only finishes after the callback */
+typedef void (*s2tc_job_callback_t)(s2tc_job_t *job, int result, void *userdata);
+
+/* queues a job behind all jobs of the same or a higher priority; callback may be NULL
+ * returns NULL on failure; every job must be released before the context is destroyed */
+s2tc_job_t *s2tc_compress_async(s2tc_context_t *ctx, const s2tc_image_t *image, int priority,
+				s2tc_job_callback_t callback, void *userdata);
+/* returns 1 if the job is finished (after its callback returned) or cancelled, 0 otherwise */
+int s2tc_job_poll(s2tc_job_t *job);
+/* waits until the job is finished or cancelled; returns its result, -1 if it was cancelled */
+int s2tc_job_wait(s2tc_job_t *job);
+/* these only affect queued jobs; return 0 on success, -1 if the job already started */
+int s2tc_job_cancel(s2tc_job_t *job);
+int s2tc_job_set_priority(s2tc_job_t *job, int priority);
+/* cancels the job if it is queued, waits for it if it is running, and frees it */
+void s2tc_job_release(s2tc_job_t *job);
+
+/* pixel formats of the decoder output */
+typedef enum
+{
+	S2TC_PIXEL_RGBA8,
+	S2TC_PIXEL_BGRA8,
+	S2TC_PIXEL_RGB565, /* native 16 bit values, red in the top bits, like GL_UNSIGNED_SHORT_5_6_5; no alpha */
+	S2TC_PIXEL_RGBA5551 /* native 16 bit values like GL_UNSIGNED_SHORT_5_5_5_1; alpha is its top bit */
+} s2tc_pixel_format_t;
+
+/* decoding, with the same dithered in-between colors as the fetch_2d_texel_* functions;
+ * transparent DXT1 pixels are transparent black */
+/* decodes the block at src into 4x4 RGBA pixels at dest, dstRowStride bytes per row */
+void s2tc_decode_block(s2tc_format_t format, const unsigned char *src, unsigned char *dest, int dstRowStride);
+/* decodes a width*height image at src (srcRowStride bytes per block row, smaller means packed)
+ * to dest in pixelformat (dstRowStride bytes per row, smaller means packed); returns 0 on success, -1 on bad arguments */
+int s2tc_decode_image(int width, int height, const unsigned char *src, int srcRowStride,
+		      s2tc_format_t format, unsigned char *dest, int dstRowStride,
+		      s2tc_pixel_format_t pixelformat);
+/* like s2tc_decode_image, but only decodes the rectangle (x, y, width, height) of an image of
+ * imageWidth*imageHeight pixels, reading only the blocks it touches; dest receives the rectangle */
+int s2tc_decode_rect(int imageWidth, int imageHeight, const unsigned char *src, int srcRowStride,
+		     int x, int y, int width, int height,
+		     s2tc_format_t format, unsigned char *dest, int dstRowStride,
+		     s2tc_pixel_format_t pixelformat);
+/* fetches the 2x2 texels (i,j), (i+1,j), (i,j+1), (i+1,j+1) in this order into texels (16 bytes of RGBA),
+ * addressed like fetch_2d_texel_* (srcRowStride is the image width in pixels); all four must lie inside the image */
+void s2tc_fetch_quad(s2tc_format_t format, int srcRowStride, const unsigned char *pixdata, int i, int j, unsigned char *texels);
+
+/* converts nblocks S3TC blocks of format at src to S2TC at dst (which may be src) by remapping their
+ * indices to the endpoints, without decoding; much faster than decoding and compressing again, for
+ * drivers receiving precompressed S3TC textures; returns 0 on success, -1 on bad arguments */
+int s2tc_transcode_from_s3tc(const unsigned char *src, unsigned char *dst, size_t nblocks, s2tc_format_t format);
+/* like s2tc_transcode_from_s3tc, but decodes the palette of each block and picks the index of every pixel
+ * by the context's color distance, then refines the endpoints by its refinement mode; close to the quality
+ * of compressing the decoded image again at a fraction of the cost; runs on the context's threads */
+int s2tc_requantize_from_s3tc(s2tc_context_t *ctx, const unsigned char *src, unsigned char *dst, size_t nblocks, s2tc_format_t format);
+
+/* the fetch_2d_texel_* functions can keep a small per-thread cache of decoded blocks, keyed by block address;
+ * it is off unless S2TC_FETCH_CACHE=1 is set or it is enabled here
+ * while it is on, s2tc_fetch_cache_invalidate must be called after changing or freeing compressed texture data
+ * and before fetching from that address again; it invalidates the caches of all threads */
+void s2tc_fetch_cache_enable(int enable);
+void s2tc_fetch_cache_invalidate(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -30,6 +30,22 @@
 #include "s2tc_algorithm.h"
 #include "s2tc_common.h"
 
+#ifdef __GNUC__
+#define S2TC_ALWAYS_INLINE __attribute__((always_inline))
+#if defined(__x86_64__) || defined(__i386__)
+#define S2TC_X86_TARGETS
+#define S2TC_TARGET(t) __attribute__((target(t)))
+// prefer-vector-width is a GCC target option; clang takes the vector width from the ISA
+#ifdef __clang__
+#define S2TC_TARGET_AVX512 S2TC_TARGET("avx512f,avx512bw")
+#else
+#define S2TC_TARGET_AVX512 S2TC_TARGET("avx512f,avx512bw,prefer-vector-width=512")
+#endif
+#endif
+#else
+#define S2TC_ALWAYS_INLINE
+#endif
+
 namespace
 {
 	template<class T> void swap(T& a, T& b)
@@ -566,43 +582,264 @@ namespace
 		}
 	};
 
-	template<class T> T get(const unsigned char *buf)
+	inline void s2tc_sort(int *v, int n)
+	{
+		// insertion sort, n <= 16
+		for(int i = 1; i < n; ++i)
+		{
+			int x = v[i], j = i;
+			for(; j > 0 && v[j - 1] > x; --j)
+				v[j] = v[j - 1];
+			v[j] = x;
+		}
+	}
+
+	// exact two level quantization of n sorted values: tries every split
+	// point with prefix sums (no pair search) and returns the one with the
+	// least squared error, or 0 if all values are equal
+	inline int s2tc_split_1d(const int *v, int n)
+	{
+		int64_t s[17];
+		int k, best = 0;
+		int64_t bestnum = 0, bestden = 1;
+		s[0] = 0;
+		for(k = 0; k < n; ++k)
+			s[k + 1] = s[k] + v[k];
+		// minimizing the squared error = maximizing S0^2/k + S1^2/(n-k)
+		for(k = 1; k < n; ++k)
+		{
+			if(v[k] == v[k - 1])
+				continue;
+			int64_t s0 = s[k], s1 = s[n] - s[k];
+			int64_t num = s0 * s0 * (n - k) + s1 * s1 * k;
+			int64_t den = (int64_t) k * (n - k);
+			if(!best || num * bestden > bestnum * den)
+			{
+				best = k;
+				bestnum = num;
+				bestden = den;
+			}
+		}
+		return best;
+	}
+
+	// rounded means of both sides of the best split
+	inline void s2tc_solve_1d(const int *v, int n, int &m0, int &m1)
+	{
+		int k, best = s2tc_split_1d(v, n);
+		int s0 = 0, s1 = 0;
+		if(!best)
+		{
+			m0 = m1 = (n > 0) ? v[0] : 0;
+			return;
+		}
+		for(k = 0; k < best; ++k)
+			s0 += v[k];
+		for(; k < n; ++k)
+			s1 += v[k];
+		m0 = (2 * s0 + best) / (2 * best);
+		m1 = (2 * s1 + (n - best)) / (2 * (n - best));
+	}
+
+	// color distances that are a quadratic form of the difference, so on a
+	// line they only depend on the distance along the line
+	template<ColorDistFunc ColorDist> struct is_quadratic
+	{
+		static const bool value = false;
+	};
+	template<> struct is_quadratic<color_dist_avg>
+	{
+		static const bool value = true;
+	};
+	template<> struct is_quadratic<color_dist_w0avg>
+	{
+		static const bool value = true;
+	};
+	template<> struct is_quadratic<color_dist_wavg>
+	{
+		static const bool value = true;
+	};
+	template<> struct is_quadratic<color_dist_yuv>
+	{
+		static const bool value = true;
+	};
+	template<> struct is_quadratic<color_dist_rgb>
+	{
+		static const bool value = true;
+	};
+
+	// colors that all lie on one line in 565 space: with a quadratic color
+	// distance, the best two colors are the means of the two halves of the
+	// best split along the line; a distance of up to one step from the line is
+	// allowed, as quantizing gray to 565 already moves g off the line by that
+	// much; returns false if the colors are not colinear, and sets online if
+	// none of them needed that allowance, which makes c0 and c1 the best pair
+	inline bool s2tc_solve_colinear(const color_t *c, int n, color_t &c0, color_t &c1, bool &online)
+	{
+		int i, k, far = 0, fardist = 0;
+		for(i = 1; i < n; ++i)
+		{
+			int dr = c[i].r - c[0].r, dg = c[i].g - c[0].g, db = c[i].b - c[0].b;
+			int dist = dr * dr + dg * dg + db * db;
+			if(dist > fardist)
+			{
+				far = i;
+				fardist = dist;
+			}
+		}
+		if(!fardist)
+			return false;
+		int dr = c[far].r - c[0].r, dg = c[far].g - c[0].g, db = c[far].b - c[0].b;
+
+		// sort by position along the line, keeping the order for the means
+		int t[16], idx[16];
+		online = true;
+		for(i = 0; i < n; ++i)
+		{
+			int er = c[i].r - c[0].r, eg = c[i].g - c[0].g, eb = c[i].b - c[0].b;
+			int xr = eg * db - eb * dg, xg = eb * dr - er * db, xb = er * dg - eg * dr;
+			int cross = xr * xr + xg * xg + xb * xb;
+			if(cross > fardist)
+				return false;
+			if(cross)
+				online = false;
+			int ti = er * dr + eg * dg + eb * db;
+			for(k = i; k > 0 && t[k - 1] > ti; --k)
+			{
+				t[k] = t[k - 1];
+				idx[k] = idx[k - 1];
+			}
+			t[k] = ti;
+			idx[k] = i;
+		}
+
+		int best = s2tc_split_1d(t, n);
+		int s[2][3] = { { 0, 0, 0 }, { 0, 0, 0 } };
+		for(k = 0; k < n; ++k)
+		{
+			const color_t &ck = c[idx[k]];
+			s[k >= best][0] += ck.r;
+			s[k >= best][1] += ck.g;
+			s[k >= best][2] += ck.b;
+		}
+		int n0 = best, n1 = n - best;
+		c0 = make_color_t((2 * s[0][0] + n0) / (2 * n0), (2 * s[0][1] + n0) / (2 * n0), (2 * s[0][2] + n0) / (2 * n0));
+		c1 = make_color_t((2 * s[1][0] + n1) / (2 * n1), (2 * s[1][1] + n1) / (2 * n1), (2 * s[1][2] + n1) / (2 * n1));
+		return true;
+	}
+
+	// random colors are seeded from the block contents, so the output does
+	// not depend on the order blocks are encoded in, or on threads
+	inline uint32_t s2tc_random_seed(const color_t *c, const unsigned char *ca, int n)
+	{
+		uint32_t h = 2166136261u;
+		for(int i = 0; i < n; ++i)
+			h = (h ^ ((unsigned char) c[i].r | ((unsigned char) c[i].g << 8) | ((unsigned char) c[i].b << 16) | (ca[i] << 24))) * 16777619u;
+		return h ? h : 1;
+	}
+
+	inline int s2tc_random(uint32_t &state)
+	{
+		// xorshift32
+		state ^= state << 13;
+		state ^= state >> 17;
+		state ^= state << 5;
+		return state >> 1;
+	}
+
+	// one 4x4 block of the rgb565 image in structure-of-arrays layout
+	// pixel i = y * 4 + x; bit i of mask is set if the pixel is inside the image
+	struct s2tc_block_t
+	{
+		unsigned char r[16], g[16], b[16], a[16];
+		unsigned int mask;
+	};
+
+	// gathers a block from the image once, all later passes only read the block
+	// full: the block is known to be a complete 4x4 block, w and h are ignored
+	template<bool full>
+	inline void s2tc_load_block(s2tc_block_t &blk, const unsigned char *rgba, int iw, int w, int h)
+	{
+		if(full)
+		{
+			for(int y = 0; y < 4; ++y) for(int x = 0; x < 4; ++x)
+			{
+				int i = y * 4 + x;
+				const unsigned char *pix = &rgba[(y * iw + x) * 4];
+				blk.r[i] = pix[0];
+				blk.g[i] = pix[1];
+				blk.b[i] = pix[2];
+				blk.a[i] = pix[3];
+			}
+			blk.mask = 0xFFFF;
+			return;
+		}
+		blk.mask = 0;
+		for(int y = 0; y < 4; ++y) for(int x = 0; x < 4; ++x)
+		{
+			int i = y * 4 + x;
+			if(x < w && y < h)
+			{
+				const unsigned char *pix = &rgba[(y * iw + x) * 4];
+				blk.r[i] = pix[0];
+				blk.g[i] = pix[1];
+				blk.b[i] = pix[2];
+				blk.a[i] = pix[3];
+				blk.mask |= 1 << i;
+			}
+			else
+			{
+				blk.r[i] = 0;
+				blk.g[i] = 0;
+				blk.b[i] = 0;
+				blk.a[i] = 0;
+			}
+		}
+	}
+
+	template<bool full>
+	inline bool pixel_valid(const s2tc_block_t &blk, int i)
+	{
+		return full || (blk.mask & (1 << i));
+	}
+
+	template<class T> T get(const s2tc_block_t &blk, int i)
 	{
 		T c;
-		c.r = buf[0];
-		c.g = buf[1];
-		c.b = buf[2];
+		c.r = blk.r[i];
+		c.g = blk.g[i];
+		c.b = blk.b[i];
 		return c;
 	}
-	template<> unsigned char get<unsigned char>(const unsigned char *buf)
+	template<> unsigned char get<unsigned char>(const s2tc_block_t &blk, int i)
 	{
-		return buf[3]; // extract alpha
+		return blk.a[i]; // extract alpha
 	}
 
-	template<class T, class Big, int bpp, bool have_trans, bool have_0_255, int n_input, class Dist, class Eval, class Arr>
+	template<class T, class Big, int bpp, bool have_trans, bool have_0_255, int n_input, bool full, class Dist, class Eval, class Arr>
 	inline unsigned int s2tc_try_encode_block(
 			Arr &out,
 			Eval &res,
 			Dist ColorDist,
-			const unsigned char *in, int iw, int w, int h,
+			const s2tc_block_t &blk,
 			const T colors_ref[])
 	{
 		unsigned int score = 0;
-		for(int x = 0; x < w; ++x) for(int y = 0; y < h; ++y)
+		for(int i = 0; i < 16; ++i)
 		{
-			int i = y * 4 + x;
-			const unsigned char *pix = &in[(y * iw + x) * 4];
+			if(!pixel_valid<full>(blk, i))
+				continue;
 
 			if(have_trans)
 			{
-				if(pix[3] == 0)
+				if(blk.a[i] == 0)
 				{
 					out.do_or(i, (1 << bpp) - 1);
 					continue;
 				}
 			}
 
-			T color(get<T>(pix));
+			T color(get<T>(blk, i));
 			int best = 0;
 			int bestdist = ColorDist(color, colors_ref[0]);
 			for(int k = 1; k < n_input; ++k)
@@ -642,34 +879,9 @@ namespace
 		return score;
 	}
 
-	// REFINE_LOOP: refine, take result over only if score improved, loop until it did not
-	inline void s2tc_dxt5_encode_alpha_refine_loop(bitarray<uint64_t, 16, 3> &out, const unsigned char *in, int iw, int w, int h, unsigned char &a0, unsigned char &a1)
+	// after refinement: make the two alpha values differ and put them in S2TC order
+	inline void s2tc_dxt5_alpha_fixup(bitarray<uint64_t, 16, 3> &out, unsigned char &a0, unsigned char &a1)
 	{
-		bitarray<uint64_t, 16, 3> out2;
-		unsigned char a0next = a0, a1next = a1;
-		unsigned int s = 0x7FFFFFFF;
-		for(;;)
-		{
-			unsigned char ramp[2] = {
-				a0next,
-				a1next
-			};
-			s2tc_evaluate_colors_result_t<unsigned char, int, 1> r2;
-			unsigned int s2 = s2tc_try_encode_block<unsigned char, int, 3, false, true, 2>(out2, r2, alpha_dist, in, iw, w, h, ramp);
-			if(s2 < s)
-			{
-				out = out2;
-				s = s2;
-				a0 = a0next;
-				a1 = a1next;
-				if(!r2.evaluate(a0next, a1next))
-					break;
-			}
-			else
-				break;
-			out2.clear();
-		}
-
 		if(a1 == a0)
 		{
 			if(a0 == 255)
@@ -705,54 +917,80 @@ namespace
 		}
 	}
 
-	// REFINE_ALWAYS: refine, do not check
-	inline void s2tc_dxt5_encode_alpha_refine_always(bitarray<uint64_t, 16, 3> &out, const unsigned char *in, int iw, int w, int h, unsigned char &a0, unsigned char &a1)
+	// after refinement: make the two colors differ and put them in S2TC order
+	template<bool have_trans>
+	inline void s2tc_dxt1_color_fixup(bitarray<uint32_t, 16, 2> &out, color_t &c0, color_t &c1)
 	{
-		unsigned char ramp[2] = {
-			a0,
-			a1
-		};
-		s2tc_evaluate_colors_result_t<unsigned char, int, 1> r2;
-		s2tc_try_encode_block<unsigned char, int, 3, false, true, 2>(out, r2, alpha_dist, in, iw, w, h, ramp);
-		r2.evaluate(a0, a1);
-
-		if(a1 == a0)
+		if(c0 == c1)
 		{
-			if(a0 == 255)
-				--a1;
+			if(c0 == color_type_info<color_t>::max_value)
+				--c1;
 			else
-				++a1;
-			for(int i = 0; i < 16; ++i) switch(out.get(i))
-			{
-				case 1:
+				++c1;
+			for(int i = 0; i < 16; ++i)
+				if(!(out.get(i) == 1))
 					out.set(i, 0);
-					break;
-			}
 		}
 
-		if(a1 < a0)
+		if(have_trans ? c1 < c0 : c0 < c1)
 		{
-			swap(a0, a1);
-			for(int i = 0; i < 16; ++i) switch(out.get(i))
+			swap(c0, c1);
+			for(int i = 0; i < 16; ++i)
+				if(!(out.get(i) & 2))
+					out.do_xor(i, 1);
+		}
+	}
+
+	// REFINE_LOOP: refine, take result over only if score improved, loop until it did not
+	template<bool full>
+	inline void s2tc_dxt5_encode_alpha_refine_loop(bitarray<uint64_t, 16, 3> &out, const s2tc_block_t &blk, unsigned char &a0, unsigned char &a1)
+	{
+		bitarray<uint64_t, 16, 3> out2;
+		unsigned char a0next = a0, a1next = a1;
+		unsigned int s = 0x7FFFFFFF;
+		for(;;)
+		{
+			unsigned char ramp[2] = {
+				a0next,
+				a1next
+			};
+			s2tc_evaluate_colors_result_t<unsigned char, int, 1> r2;
+			unsigned int s2 = s2tc_try_encode_block<unsigned char, int, 3, false, true, 2, full>(out2, r2, alpha_dist, blk, ramp);
+			if(s2 < s)
 			{
-				case 0:
-					out.set(i, 1);
-					break;
-				case 1:
-					out.set(i, 0);
-					break;
-				case 6:
-				case 7:
-					break;
-				default:
-					out.set(i, 7 - out.get(i));
+				out = out2;
+				s = s2;
+				a0 = a0next;
+				a1 = a1next;
+				if(!r2.evaluate(a0next, a1next))
 					break;
 			}
+			else
+				break;
+			out2.clear();
 		}
+
+		s2tc_dxt5_alpha_fixup(out, a0, a1);
+	}
+
+	// REFINE_ALWAYS: refine, do not check
+	template<bool full>
+	inline void s2tc_dxt5_encode_alpha_refine_always(bitarray<uint64_t, 16, 3> &out, const s2tc_block_t &blk, unsigned char &a0, unsigned char &a1)
+	{
+		unsigned char ramp[2] = {
+			a0,
+			a1
+		};
+		s2tc_evaluate_colors_result_t<unsigned char, int, 1> r2;
+		s2tc_try_encode_block<unsigned char, int, 3, false, true, 2, full>(out, r2, alpha_dist, blk, ramp);
+		r2.evaluate(a0, a1);
+
+		s2tc_dxt5_alpha_fixup(out, a0, a1);
 	}
 
 	// REFINE_NEVER: do not refine
-	inline void s2tc_dxt5_encode_alpha_refine_never(bitarray<uint64_t, 16, 3> &out, const unsigned char *in, int iw, int w, int h, unsigned char &a0, unsigned char &a1)
+	template<bool full>
+	inline void s2tc_dxt5_encode_alpha_refine_never(bitarray<uint64_t, 16, 3> &out, const s2tc_block_t &blk, unsigned char &a0, unsigned char &a1)
 	{
 		if(a1 < a0)
 			swap(a0, a1);
@@ -761,12 +999,12 @@ namespace
 			a1
 		};
 		s2tc_evaluate_colors_result_null_t<unsigned char> r2;
-		s2tc_try_encode_block<unsigned char, int, 3, false, true, 2>(out, r2, alpha_dist, in, iw, w, h, ramp);
+		s2tc_try_encode_block<unsigned char, int, 3, false, true, 2, full>(out, r2, alpha_dist, blk, ramp);
 	}
 
 	// REFINE_LOOP: refine, take result over only if score improved, loop until it did not
-	template<ColorDistFunc ColorDist, bool have_trans>
-	inline void s2tc_dxt1_encode_color_refine_loop(bitarray<uint32_t, 16, 2> &out, const unsigned char *in, int iw, int w, int h, color_t &c0, color_t &c1)
+	template<ColorDistFunc ColorDist, bool have_trans, bool full>
+	inline void s2tc_dxt1_encode_color_refine_loop(bitarray<uint32_t, 16, 2> &out, const s2tc_block_t &blk, color_t &c0, color_t &c1)
 	{
 		bitarray<uint32_t, 16, 2> out2;
 		color_t c0next = c0, c1next = c1;
@@ -778,7 +1016,7 @@ namespace
 				c1next
 			};
 			s2tc_evaluate_colors_result_t<color_t, bigcolor_t, 1> r2;
-			unsigned int s2 = s2tc_try_encode_block<color_t, bigcolor_t, 2, have_trans, false, 2>(out2, r2, ColorDist, in, iw, w, h, ramp);
+			unsigned int s2 = s2tc_try_encode_block<color_t, bigcolor_t, 2, have_trans, false, 2, full>(out2, r2, ColorDist, blk, ramp);
 			if(s2 < s)
 			{
 				out = out2;
@@ -793,61 +1031,27 @@ namespace
 			out2.clear();
 		}
 
-		if(c0 == c1)
-		{
-			if(c0 == color_type_info<color_t>::max_value)
-				--c1;
-			else
-				++c1;
-			for(int i = 0; i < 16; ++i)
-				if(!(out.get(i) == 1))
-					out.set(i, 0);
-		}
-
-		if(have_trans ? c1 < c0 : c0 < c1)
-		{
-			swap(c0, c1);
-			for(int i = 0; i < 16; ++i)
-				if(!(out.get(i) & 2))
-					out.do_xor(i, 1);
-		}
+		s2tc_dxt1_color_fixup<have_trans>(out, c0, c1);
 	}
 
 	// REFINE_ALWAYS: refine, do not check
-	template<ColorDistFunc ColorDist, bool have_trans>
-	inline void s2tc_dxt1_encode_color_refine_always(bitarray<uint32_t, 16, 2> &out, const unsigned char *in, int iw, int w, int h, color_t &c0, color_t &c1)
+	template<ColorDistFunc ColorDist, bool have_trans, bool full>
+	inline void s2tc_dxt1_encode_color_refine_always(bitarray<uint32_t, 16, 2> &out, const s2tc_block_t &blk, color_t &c0, color_t &c1)
 	{
 		color_t ramp[2] = {
 			c0,
 			c1
 		};
 		s2tc_evaluate_colors_result_t<color_t, bigcolor_t, 1> r2;
-		s2tc_try_encode_block<color_t, bigcolor_t, 2, have_trans, false, 2>(out, r2, ColorDist, in, iw, w, h, ramp);
+		s2tc_try_encode_block<color_t, bigcolor_t, 2, have_trans, false, 2, full>(out, r2, ColorDist, blk, ramp);
 		r2.evaluate(c0, c1);
 
-		if(c0 == c1)
-		{
-			if(c0 == color_type_info<color_t>::max_value)
-				--c1;
-			else
-				++c1;
-			for(int i = 0; i < 16; ++i)
-				if(!(out.get(i) == 1))
-					out.set(i, 0);
-		}
-
-		if(have_trans ? c1 < c0 : c0 < c1)
-		{
-			swap(c0, c1);
-			for(int i = 0; i < 16; ++i)
-				if(!(out.get(i) & 2))
-					out.do_xor(i, 1);
-		}
+		s2tc_dxt1_color_fixup<have_trans>(out, c0, c1);
 	}
 
 	// REFINE_NEVER: do not refine
-	template<ColorDistFunc ColorDist, bool have_trans>
-	inline void s2tc_dxt1_encode_color_refine_never(bitarray<uint32_t, 16, 2> &out, const unsigned char *in, int iw, int w, int h, color_t &c0, color_t &c1)
+	template<ColorDistFunc ColorDist, bool have_trans, bool full>
+	inline void s2tc_dxt1_encode_color_refine_never(bitarray<uint32_t, 16, 2> &out, const s2tc_block_t &blk, color_t &c0, color_t &c1)
 	{
 		if(have_trans ? c1 < c0 : c0 < c1)
 			swap(c0, c1);
@@ -856,54 +1060,256 @@ namespace
 			c1
 		};
 		s2tc_evaluate_colors_result_null_t<color_t> r2;
-		s2tc_try_encode_block<color_t, bigcolor_t, 2, have_trans, false, 2>(out, r2, ColorDist, in, iw, w, h, ramp);
+		s2tc_try_encode_block<color_t, bigcolor_t, 2, have_trans, false, 2, full>(out, r2, ColorDist, blk, ramp);
 	}
 
-	inline void s2tc_dxt3_encode_alpha(bitarray<uint64_t, 16, 4> &out, const unsigned char *in, int iw, int w, int h)
+	template<bool full>
+	inline void s2tc_dxt3_encode_alpha(bitarray<uint64_t, 16, 4> &out, const s2tc_block_t &blk)
 	{
-		for(int x = 0; x < w; ++x) for(int y = 0; y < h; ++y)
+		for(int i = 0; i < 16; ++i)
 		{
-			int i = y * 4 + x;
-			const unsigned char *pix = &in[(y * iw + x) * 4];
-			out.do_or(i, pix[3]);
+			if(!pixel_valid<full>(blk, i))
+				continue;
+			out.do_or(i, blk.a[i]);
 		}
 	}
 
-	template<DxtMode dxt, ColorDistFunc ColorDist, CompressionMode mode, RefinementMode refine>
-	inline void s2tc_encode_block(unsigned char *out, const unsigned char *rgba, int iw, int w, int h, int nrandom)
+	// at most two distinct colors (not counting transparent pixels for DXT1)
+	// and, for DXT5, at most two distinct alpha values besides 0 and 255:
+	// these are the endpoints of a lossless encoding
+	template<DxtMode dxt, bool full>
+	inline bool s2tc_exact_colors(const s2tc_block_t &blk, color_t *c, unsigned char *ca)
 	{
-		color_t c[16 + (nrandom >= 0 ? nrandom : 0)];
-		unsigned char ca[16 + (nrandom >= 0 ? nrandom : 0)];
-		int x, y;
-
-		if(mode == MODE_FAST)
+		int nc = 0, na = 0;
+		for(int i = 0; i < 16; ++i)
 		{
-			// FAST: trick from libtxc_dxtn: just get brightest and darkest colors, and encode using these
+			if(!pixel_valid<full>(blk, i))
+				continue;
+			unsigned char a = blk.a[i];
+			if(dxt == DXT1 && a == 0)
+				continue;
+			if(dxt == DXT5 && a != 0 && a != 255 && !(na > 0 && ca[0] == a) && !(na > 1 && ca[1] == a))
+			{
+				if(na == 2)
+					return false;
+				ca[na++] = a;
+			}
+			color_t ci = get<color_t>(blk, i);
+			if(!(nc > 0 && c[0] == ci) && !(nc > 1 && c[1] == ci))
+			{
+				if(nc == 2)
+					return false;
+				c[nc++] = ci;
+			}
+		}
+		if(nc == 0)
+			c[nc++] = make_color_t(0, 0, 0);
+		if(nc == 1)
+			c[1] = c[0];
+		if(dxt == DXT5)
+		{
+			if(na == 0)
+				ca[na++] = 0;
+			if(na == 1)
+				ca[1] = ca[0];
+		}
+		return true;
+	}
 
-			color_t c0 = make_color_t(0, 0, 0);
+	// endpoints of a block already encoded in the same format
+	template<DxtMode dxt>
+	inline void s2tc_block_endpoints(const unsigned char *in, color_t *c, unsigned char *ca)
+	{
+		const unsigned char *cb = (dxt == DXT1) ? in : in + 8;
+		for(int k = 0; k < 2; ++k)
+		{
+			int v = cb[2 * k] | (cb[2 * k + 1] << 8);
+			c[k] = make_color_t(v >> 11, (v >> 5) & 0x3F, v & 0x1F);
+			ca[k] = (dxt == DXT5) ? in[k] : 0;
+		}
+	}
 
-			// dummy values because we don't know whether the first pixel will write
-			c[0].r = 31;
-			c[0].g = 63;
-			c[0].b = 31;
-			c[1].r = 0;
-			c[1].g = 0;
-			c[1].b = 0;
-			int dmin = 0x7FFFFFFF;
-			int dmax = 0;
-			if(dxt == DXT5)
+	// the seed endpoint pairs that fit the n input colors best, and their error
+	template<DxtMode dxt, ColorDistFunc ColorDist>
+	inline void s2tc_best_seed(const color_t *c, const unsigned char *ca, int n, const color_t *sc, const unsigned char *sca, int nseeds, int &best, int &err, int &besta, int &erra)
+	{
+		best = besta = 0;
+		err = erra = 0x7FFFFFFF;
+		for(int s = 0; s < nseeds; ++s)
+		{
+			int e = 0, ea = 0;
+			for(int k = 0; k < n; ++k)
 			{
-				ca[0] = rgba[3];
-				ca[1] = ca[0];
+				e += min(ColorDist(c[k], sc[2 * s]), ColorDist(c[k], sc[2 * s + 1]));
+				if(dxt == DXT5)
+					ea += min(min(alpha_dist(ca[k], sca[2 * s]), alpha_dist(ca[k], sca[2 * s + 1])), min(alpha_dist(ca[k], 0), alpha_dist(ca[k], 255)));
 			}
-
-			for(x = 0; x < w; ++x)
-				for(y = 0; y < h; ++y)
+			if(e < err)
+			{
+				err = e;
+				best = s;
+			}
+			if(ea < erra)
+			{
+				erra = ea;
+				besta = s;
+			}
+		}
+	}
+
+	// picks the indices of blk for the endpoints c[0], c[1] (and ca[0], ca[1]
+	// for DXT5), refines the endpoints as requested and writes the block
+	template<DxtMode dxt, ColorDistFunc ColorDist, bool full>
+	inline void s2tc_encode_endpoints(unsigned char *out, const s2tc_block_t &blk, color_t *c, unsigned char *ca, RefinementMode refine)
+	{
+		// equal colors are BAD
+		if(c[0] == c[1])
+		{
+			if(c[0] == color_type_info<color_t>::max_value)
+				--c[1];
+			else
+				++c[1];
+		}
+
+		if(dxt == DXT5)
+		{
+			if(ca[0] == ca[1])
+			{
+				if(ca[0] == 255)
+					--ca[1];
+				else
+					++ca[1];
+			}
+		}
+
+		switch(dxt)
+		{
+			case DXT1:
+				{
+					bitarray<uint32_t, 16, 2> colorblock;
+					switch(refine)
+					{
+						case REFINE_NEVER:
+							s2tc_dxt1_encode_color_refine_never<ColorDist, true, full>(colorblock, blk, c[0], c[1]);
+							break;
+						case REFINE_ALWAYS:
+							s2tc_dxt1_encode_color_refine_always<ColorDist, true, full>(colorblock, blk, c[0], c[1]);
+							break;
+						case REFINE_LOOP:
+							s2tc_dxt1_encode_color_refine_loop<ColorDist, true, full>(colorblock, blk, c[0], c[1]);
+							break;
+					}
+					out[0] = ((c[0].g & 0x07) << 5) | c[0].b;
+					out[1] = (c[0].r << 3) | (c[0].g >> 3);
+					out[2] = ((c[1].g & 0x07) << 5) | c[1].b;
+					out[3] = (c[1].r << 3) | (c[1].g >> 3);
+					colorblock.tobytes(&out[4]);
+				}
+				break;
+			case DXT3:
+				{
+					bitarray<uint32_t, 16, 2> colorblock;
+					bitarray<uint64_t, 16, 4> alphablock;
+					switch(refine)
+					{
+						case REFINE_NEVER:
+							s2tc_dxt1_encode_color_refine_never<ColorDist, false, full>(colorblock, blk, c[0], c[1]);
+							break;
+						case REFINE_ALWAYS:
+							s2tc_dxt1_encode_color_refine_always<ColorDist, false, full>(colorblock, blk, c[0], c[1]);
+							break;
+						case REFINE_LOOP:
+							s2tc_dxt1_encode_color_refine_loop<ColorDist, false, full>(colorblock, blk, c[0], c[1]);
+							break;
+					}
+					s2tc_dxt3_encode_alpha<full>(alphablock, blk);
+					alphablock.tobytes(&out[0]);
+					out[8] = ((c[0].g & 0x07) << 5) | c[0].b;
+					out[9] = (c[0].r << 3) | (c[0].g >> 3);
+					out[10] = ((c[1].g & 0x07) << 5) | c[1].b;
+					out[11] = (c[1].r << 3) | (c[1].g >> 3);
+					colorblock.tobytes(&out[12]);
+				}
+				break;
+			case DXT5:
+				{
+					bitarray<uint32_t, 16, 2> colorblock;
+					bitarray<uint64_t, 16, 3> alphablock;
+					switch(refine)
+					{
+						case REFINE_NEVER:
+							s2tc_dxt1_encode_color_refine_never<ColorDist, false, full>(colorblock, blk, c[0], c[1]);
+							s2tc_dxt5_encode_alpha_refine_never<full>(alphablock, blk, ca[0], ca[1]);
+							break;
+						case REFINE_ALWAYS:
+							s2tc_dxt1_encode_color_refine_always<ColorDist, false, full>(colorblock, blk, c[0], c[1]);
+							s2tc_dxt5_encode_alpha_refine_always<full>(alphablock, blk, ca[0], ca[1]);
+							break;
+						case REFINE_LOOP:
+							s2tc_dxt1_encode_color_refine_loop<ColorDist, false, full>(colorblock, blk, c[0], c[1]);
+							s2tc_dxt5_encode_alpha_refine_loop<full>(alphablock, blk, ca[0], ca[1]);
+							break;
+					}
+					out[0] = ca[0];
+					out[1] = ca[1];
+					alphablock.tobytes(&out[2]);
+					out[8] = ((c[0].g & 0x07) << 5) | c[0].b;
+					out[9] = (c[0].r << 3) | (c[0].g >> 3);
+					out[10] = ((c[1].g & 0x07) << 5) | c[1].b;
+					out[11] = (c[1].r << 3) | (c[1].g >> 3);
+					colorblock.tobytes(&out[12]);
+				}
+				break;
+		}
+	}
+
+	// seeds: nseeds blocks already encoded in the same format (e.g. the
+	// neighbors), whose endpoints are added to the candidate colors
+	template<DxtMode dxt, ColorDistFunc ColorDist, CompressionMode mode, RefinementMode refine, bool full>
+	inline void s2tc_encode_block(unsigned char *out, const unsigned char *rgba, int iw, int w, int h, int nrandom, const unsigned char *const *seeds, int nseeds)
+	{
+		color_t c[16 + (nrandom >= 0 ? nrandom : 0) + 4];
+		unsigned char ca[16 + (nrandom >= 0 ? nrandom : 0) + 4];
+		int x, y;
+
+		s2tc_block_t blk;
+		s2tc_load_block<full>(blk, rgba, iw, w, h);
+
+		// lossless blocks need neither the search nor the refinement; this
+		// also holds for MODE_FAST, whose darkest/brightest pick keeps only
+		// one of two colors at the same distance from black
+		bool exact = false;
+		if(s2tc_exact_colors<dxt, full>(blk, c, ca))
+			exact = true;
+		else if(mode == MODE_FAST)
+		{
+			// FAST: trick from libtxc_dxtn: just get brightest and darkest colors, and encode using these
+
+			color_t c0 = make_color_t(0, 0, 0);
+
+			// dummy values because we don't know whether the first pixel will write
+			c[0].r = 31;
+			c[0].g = 63;
+			c[0].b = 31;
+			c[1].r = 0;
+			c[1].g = 0;
+			c[1].b = 0;
+			int dmin = 0x7FFFFFFF;
+			int dmax = 0;
+			if(dxt == DXT5)
+			{
+				ca[0] = blk.a[0];
+				ca[1] = ca[0];
+			}
+
+			for(x = 0; x < 4; ++x)
+				for(y = 0; y < 4; ++y)
 				{
-					c[2].r = rgba[(x + y * iw) * 4 + 0];
-					c[2].g = rgba[(x + y * iw) * 4 + 1];
-					c[2].b = rgba[(x + y * iw) * 4 + 2];
-					ca[2]  = rgba[(x + y * iw) * 4 + 3];
+					int i = y * 4 + x;
+					if(!pixel_valid<full>(blk, i))
+						continue;
+					c[2] = get<color_t>(blk, i);
+					ca[2] = blk.a[i];
 					if (dxt == DXT1)
 						if(ca[2] == 0)
 							continue;
@@ -937,13 +1343,14 @@ namespace
 		{
 			int n = 0, m = 0;
 
-			for(x = 0; x < w; ++x)
-				for(y = 0; y < h; ++y)
+			for(x = 0; x < 4; ++x)
+				for(y = 0; y < 4; ++y)
 				{
-					c[n].r = rgba[(x + y * iw) * 4 + 0];
-					c[n].g = rgba[(x + y * iw) * 4 + 1];
-					c[n].b = rgba[(x + y * iw) * 4 + 2];
-					ca[n]  = rgba[(x + y * iw) * 4 + 3];
+					int i = y * 4 + x;
+					if(!pixel_valid<full>(blk, i))
+						continue;
+					c[n] = get<color_t>(blk, i);
+					ca[n] = blk.a[i];
 					if (dxt == DXT1)
 						if(ca[n] == 0)
 							continue;
@@ -959,167 +1366,902 @@ namespace
 			}
 			m = n;
 
-			if(nrandom > 0)
+			// gray and other colinear blocks: 1-D solve; exactly on the line it
+			// is the best pair, otherwise it is one more candidate pair
+			color_t l0, l1;
+			bool online = false;
+			bool colinear = is_quadratic<ColorDist>::value && n > 2 && s2tc_solve_colinear(c, n, l0, l1, online);
+			bool solved = colinear && online;
+
+			// a solved block only needs the other candidates for DXT5 alpha
+			if(!solved || dxt == DXT5)
 			{
-				color_t mins = c[0];
-				color_t maxs = c[0];
-				unsigned char mina = (dxt == DXT5) ? ca[0] : 0;
-				unsigned char maxa = (dxt == DXT5) ? ca[0] : 0;
-				for(x = 1; x < n; ++x)
+				// only the best fitting seed pair becomes a candidate; the seeds
+				// stand in for random colors, so they are used only with these
+				if(nrandom <= 0)
+					nseeds = 0;
+				color_t sc[2 * nseeds];
+				unsigned char sca[2 * nseeds];
+				int best = 0, besta = 0, err = 0, erra = 0;
+				for(x = 0; x < nseeds; ++x)
+					s2tc_block_endpoints<dxt>(seeds[x], &sc[2 * x], &sca[2 * x]);
+				if(nseeds > 0)
+					s2tc_best_seed<dxt, ColorDist>(c, ca, n, sc, sca, nseeds, best, err, besta, erra);
+
+				if(nrandom > 0)
 				{
-					mins.r = min(mins.r, c[x].r);
-					mins.g = min(mins.g, c[x].g);
-					mins.b = min(mins.b, c[x].b);
-					maxs.r = max(maxs.r, c[x].r);
-					maxs.g = max(maxs.g, c[x].g);
-					maxs.b = max(maxs.b, c[x].b);
-					if(dxt == DXT5)
+					color_t mins = c[0];
+					color_t maxs = c[0];
+					unsigned char mina = (dxt == DXT5) ? ca[0] : 0;
+					unsigned char maxa = (dxt == DXT5) ? ca[0] : 0;
+					for(x = 1; x < n; ++x)
 					{
-						mina = min(mina, ca[x]);
-						maxa = max(maxa, ca[x]);
+						mins.r = min(mins.r, c[x].r);
+						mins.g = min(mins.g, c[x].g);
+						mins.b = min(mins.b, c[x].b);
+						maxs.r = max(maxs.r, c[x].r);
+						maxs.g = max(maxs.g, c[x].g);
+						maxs.b = max(maxs.b, c[x].b);
+						if(dxt == DXT5)
+						{
+							mina = min(mina, ca[x]);
+							maxa = max(maxa, ca[x]);
+						}
+					}
+					color_t len = make_color_t(maxs.r - mins.r + 1, maxs.g - mins.g + 1, maxs.b - mins.b + 1);
+					int lena = (dxt == DXT5) ? (maxa - (int) mina + 1) : 0;
+
+					// a seed pair that already fits the block well leaves
+					// little for the random colors to find
+					int nr = nrandom;
+					if(nseeds > 0 && (int64_t) err * 4 <= (int64_t) n * ColorDist(mins, maxs) && (dxt != DXT5 || (int64_t) erra * 4 <= (int64_t) n * alpha_dist(mina, maxa)))
+						nr = nrandom / 4;
+
+					uint32_t rng = s2tc_random_seed(c, ca, n);
+					for(x = 0; x < nr; ++x)
+					{
+						c[m].r = mins.r + s2tc_random(rng) % len.r;
+						c[m].g = mins.g + s2tc_random(rng) % len.g;
+						c[m].b = mins.b + s2tc_random(rng) % len.b;
+						if(dxt == DXT5)
+							ca[m] = mina + s2tc_random(rng) % lena;
+						++m;
 					}
 				}
-				color_t len = make_color_t(maxs.r - mins.r + 1, maxs.g - mins.g + 1, maxs.b - mins.b + 1);
-				int lena = (dxt == DXT5) ? (maxa - (int) mina + 1) : 0;
-				for(x = 0; x < nrandom; ++x)
+				else
 				{
-					c[m].r = mins.r + rand() % len.r;
-					c[m].g = mins.g + rand() % len.g;
-					c[m].b = mins.b + rand() % len.b;
-					if(dxt == DXT5)
-						ca[m] = mina + rand() % lena;
+					// hack for last miplevel
+					if(n == 1)
+					{
+						c[1] = c[0];
+						m = n = 2;
+					}
+				}
+
+				if(nseeds > 0)
+				{
+					c[m] = sc[2 * best];
+					ca[m] = sca[2 * besta];
+					++m;
+					c[m] = sc[2 * best + 1];
+					ca[m] = sca[2 * besta + 1];
 					++m;
 				}
 			}
+
+			if(solved)
+			{
+				c[0] = l0;
+				c[1] = l1;
+			}
+			else if(colinear)
+			{
+				// past m, so only the colors see them, not the alpha candidates
+				c[m] = l0;
+				c[m + 1] = l1;
+				reduce_colors_inplace(c, n, m + 2, ColorDist);
+			}
+			else
+				reduce_colors_inplace(c, n, m, ColorDist);
+			if(dxt == DXT5)
+				reduce_colors_inplace_2fixpoints(ca, n, m, alpha_dist, (unsigned char) 0, (unsigned char) 255);
+		}
+
+		s2tc_encode_endpoints<dxt, ColorDist, full>(out, blk, c, ca, exact ? REFINE_NEVER : refine);
+	}
+
+	// decodes an S3TC block with its full palette into blk, in the units of
+	// rgb565_image output (4 bit alpha for DXT3), and returns its endpoints
+	template<DxtMode dxt>
+	inline void s3tc_load_block(s2tc_block_t &blk, const unsigned char *in, color_t *c, unsigned char *ca)
+	{
+		const unsigned char *cb = (dxt == DXT1) ? in : in + 8;
+		int v0 = cb[0] | (cb[1] << 8);
+		int v1 = cb[2] | (cb[3] << 8);
+		color_t pal[4];
+		unsigned char pala[4] = { 255, 255, 255, 255 };
+		pal[0] = make_color_t(v0 >> 11, (v0 >> 5) & 0x3F, v0 & 0x1F);
+		pal[1] = make_color_t(v1 >> 11, (v1 >> 5) & 0x3F, v1 & 0x1F);
+		// DXT3 and DXT5 always use the four color palette
+		if(dxt != DXT1 || v0 > v1)
+		{
+			pal[2] = make_color_t((2 * pal[0].r + pal[1].r + 1) / 3, (2 * pal[0].g + pal[1].g + 1) / 3, (2 * pal[0].b + pal[1].b + 1) / 3);
+			pal[3] = make_color_t((pal[0].r + 2 * pal[1].r + 1) / 3, (pal[0].g + 2 * pal[1].g + 1) / 3, (pal[0].b + 2 * pal[1].b + 1) / 3);
+		}
+		else
+		{
+			pal[2] = make_color_t((pal[0].r + pal[1].r + 1) >> 1, (pal[0].g + pal[1].g + 1) >> 1, (pal[0].b + pal[1].b + 1) >> 1);
+			pal[3] = make_color_t(0, 0, 0);
+			pala[3] = 0;
+		}
+		uint32_t bits = cb[4] | (cb[5] << 8) | (cb[6] << 16) | (((uint32_t) cb[7]) << 24);
+		for(int i = 0; i < 16; ++i)
+		{
+			int k = (bits >> (2 * i)) & 3;
+			blk.r[i] = pal[k].r;
+			blk.g[i] = pal[k].g;
+			blk.b[i] = pal[k].b;
+			blk.a[i] = pala[k];
+		}
+		blk.mask = 0xFFFF;
+		c[0] = pal[0];
+		c[1] = pal[1];
+
+		if(dxt == DXT3)
+		{
+			for(int i = 0; i < 16; ++i)
+				blk.a[i] = (in[i >> 1] >> (4 * (i & 1))) & 0x0F;
+		}
+		else if(dxt == DXT5)
+		{
+			int a0 = in[0], a1 = in[1];
+			unsigned char ramp[8];
+			ramp[0] = a0;
+			ramp[1] = a1;
+			if(a0 > a1)
+			{
+				for(int k = 2; k < 8; ++k)
+					ramp[k] = ((8 - k) * a0 + (k - 1) * a1 + 3) / 7;
+			}
 			else
 			{
-				// hack for last miplevel
-				if(n == 1)
-				{
-					c[1] = c[0];
-					m = n = 2;
-				}
+				for(int k = 2; k < 6; ++k)
+					ramp[k] = ((6 - k) * a0 + (k - 1) * a1 + 2) / 5;
+				ramp[6] = 0;
+				ramp[7] = 255;
+			}
+			uint64_t abits = 0;
+			for(int k = 0; k < 6; ++k)
+				abits |= ((uint64_t) in[2 + k]) << (8 * k);
+			for(int i = 0; i < 16; ++i)
+				blk.a[i] = ramp[(abits >> (3 * i)) & 7];
+			ca[0] = a0;
+			ca[1] = a1;
+		}
+	}
+
+	// S3TC to S2TC with the color distance: starts from the endpoints of the
+	// source block and picks the indices against its decoded pixels, so the
+	// in-between palette entries go to the nearer endpoint
+	template<DxtMode dxt, ColorDistFunc ColorDist, RefinementMode refine>
+	void s2tc_transcode_blocks(unsigned char *out, const unsigned char *in, size_t nblocks)
+	{
+		const size_t blocksize = (dxt == DXT1) ? 8 : 16;
+		for(size_t i = 0; i < nblocks; ++i, in += blocksize, out += blocksize)
+		{
+			s2tc_block_t blk;
+			color_t c[2];
+			unsigned char ca[2] = { 0, 0 };
+			s3tc_load_block<dxt>(blk, in, c, ca);
+			s2tc_encode_endpoints<dxt, ColorDist, true>(out, blk, c, ca, refine);
+		}
+	}
+
+	// cross-block engine: encodes "lanes" consecutive complete blocks of a
+	// block row in lockstep, one block per vector lane
+	// only MODE_FAST selection with REFINE_NEVER or REFINE_ALWAYS is
+	// implemented; the output is identical to s2tc_encode_block
+	// lossless blocks take their colors as they are, without refinement, as
+	// in s2tc_encode_block
+	template<DxtMode dxt, ColorDistFunc ColorDist, RefinementMode refine, int lanes>
+	inline S2TC_ALWAYS_INLINE void s2tc_encode_lanes(unsigned char *out, const unsigned char *rgba, int iw)
+	{
+		const bool have_trans = (dxt == DXT1);
+		const int blocksize = (dxt == DXT1) ? 8 : 16;
+		int r[16][lanes], g[16][lanes], b[16][lanes], a[16][lanes];
+		int c0r[lanes], c0g[lanes], c0b[lanes];
+		int c1r[lanes], c1g[lanes], c1b[lanes];
+		int a0[lanes], a1[lanes];
+		// the up to two distinct colors and alpha values seen, as for
+		// s2tc_exact_colors; lossy is set once a third one shows up
+		int k0[lanes], k1[lanes], h0[lanes], h1[lanes];
+		int ak0[lanes], ak1[lanes], ah0[lanes], ah1[lanes];
+		int lossy[lanes];
+		int i, l;
+
+		for(i = 0; i < 16; ++i)
+		{
+			const unsigned char *pix = &rgba[((i >> 2) * iw + (i & 3)) * 4];
+			for(l = 0; l < lanes; ++l)
+			{
+				r[i][l] = pix[l * 16 + 0];
+				g[i][l] = pix[l * 16 + 1];
+				b[i][l] = pix[l * 16 + 2];
+				a[i][l] = pix[l * 16 + 3];
+			}
+		}
+
+		// FAST: darkest and brightest colors, same scan order as s2tc_encode_block
+		{
+			int dmin[lanes], dmax[lanes];
+			for(l = 0; l < lanes; ++l)
+			{
+				c0r[l] = 31;
+				c0g[l] = 63;
+				c0b[l] = 31;
+				c1r[l] = 0;
+				c1g[l] = 0;
+				c1b[l] = 0;
+				dmin[l] = 0x7FFFFFFF;
+				dmax[l] = 0;
+				a0[l] = a[0][l];
+				a1[l] = a[0][l];
+				k0[l] = k1[l] = h0[l] = h1[l] = 0;
+				ak0[l] = ak1[l] = ah0[l] = ah1[l] = 0;
+				lossy[l] = 0;
+			}
+			// updates are all-ones/all-zero masks so the lane loops stay
+			// branch free and vectorize
+			for(int x = 0; x < 4; ++x) for(int y = 0; y < 4; ++y)
+			{
+				const int *ri = r[y * 4 + x], *gi = g[y * 4 + x], *bi = b[y * 4 + x], *ai = a[y * 4 + x];
+				for(l = 0; l < lanes; ++l)
+				{
+					int use = have_trans ? -(ai[l] != 0) : -1;
+					int d = ColorDist(make_color_t(ri[l], gi[l], bi[l]), make_color_t(0, 0, 0));
+					int upmax = use & -(d > dmax[l]);
+					int upmin = use & -(d < dmin[l]);
+					dmax[l] = (d & upmax) | (dmax[l] & ~upmax);
+					c1r[l] = (ri[l] & upmax) | (c1r[l] & ~upmax);
+					c1g[l] = (gi[l] & upmax) | (c1g[l] & ~upmax);
+					c1b[l] = (bi[l] & upmax) | (c1b[l] & ~upmax);
+					dmin[l] = (d & upmin) | (dmin[l] & ~upmin);
+					c0r[l] = (ri[l] & upmin) | (c0r[l] & ~upmin);
+					c0g[l] = (gi[l] & upmin) | (c0g[l] & ~upmin);
+					c0b[l] = (bi[l] & upmin) | (c0b[l] & ~upmin);
+
+					int key = (ri[l] << 11) | (gi[l] << 5) | bi[l];
+					int fresh = use & ~(h0[l] & -(key == k0[l])) & ~(h1[l] & -(key == k1[l]));
+					int t0 = fresh & ~h0[l];
+					int t1 = fresh & h0[l] & ~h1[l];
+					lossy[l] |= fresh & h0[l] & h1[l];
+					k0[l] = (key & t0) | (k0[l] & ~t0);
+					h0[l] |= t0;
+					k1[l] = (key & t1) | (k1[l] & ~t1);
+					h1[l] |= t1;
+
+					if(dxt == DXT5)
+					{
+						int counted = -(ai[l] != 255);
+						int up1 = counted & -(ai[l] > a1[l]);
+						int up0 = counted & -(ai[l] < a0[l]);
+						a1[l] = (ai[l] & up1) | (a1[l] & ~up1);
+						a0[l] = (ai[l] & up0) | (a0[l] & ~up0);
+
+						// 0 and 255 have their own indices
+						int afresh = counted & -(ai[l] != 0) & ~(ah0[l] & -(ai[l] == ak0[l])) & ~(ah1[l] & -(ai[l] == ak1[l]));
+						int at0 = afresh & ~ah0[l];
+						int at1 = afresh & ah0[l] & ~ah1[l];
+						lossy[l] |= afresh & ah0[l] & ah1[l];
+						ak0[l] = (ai[l] & at0) | (ak0[l] & ~at0);
+						ah0[l] |= at0;
+						ak1[l] = (ai[l] & at1) | (ak1[l] & ~at1);
+						ah1[l] |= at1;
+					}
+				}
+			}
+		}
+
+		// lossless: the colors found, one of them twice if there is only one
+		for(l = 0; l < lanes; ++l)
+		{
+			int keep = lossy[l];
+			int e0 = (k0[l] & h0[l]), e1 = (k1[l] & h1[l]) | (e0 & ~h1[l]);
+			c0r[l] = (c0r[l] & keep) | ((e0 >> 11) & ~keep);
+			c0g[l] = (c0g[l] & keep) | (((e0 >> 5) & 0x3F) & ~keep);
+			c0b[l] = (c0b[l] & keep) | ((e0 & 0x1F) & ~keep);
+			c1r[l] = (c1r[l] & keep) | ((e1 >> 11) & ~keep);
+			c1g[l] = (c1g[l] & keep) | (((e1 >> 5) & 0x3F) & ~keep);
+			c1b[l] = (c1b[l] & keep) | ((e1 & 0x1F) & ~keep);
+			if(dxt == DXT5)
+			{
+				int f0 = (ak0[l] & ah0[l]), f1 = (ak1[l] & ah1[l]) | (f0 & ~ah1[l]);
+				a0[l] = (a0[l] & keep) | (f0 & ~keep);
+				a1[l] = (a1[l] & keep) | (f1 & ~keep);
+			}
+		}
+
+		// equal colors are BAD
+		for(l = 0; l < lanes; ++l)
+		{
+			color_t c0 = make_color_t(c0r[l], c0g[l], c0b[l]);
+			color_t c1 = make_color_t(c1r[l], c1g[l], c1b[l]);
+			if(c0 == c1)
+			{
+				if(c0 == color_type_info<color_t>::max_value)
+					--c1;
+				else
+					++c1;
+			}
+			if(refine == REFINE_NEVER || !lossy[l])
+				if(have_trans ? c1 < c0 : c0 < c1)
+					swap(c0, c1);
+			c0r[l] = c0.r;
+			c0g[l] = c0.g;
+			c0b[l] = c0.b;
+			c1r[l] = c1.r;
+			c1g[l] = c1.g;
+			c1b[l] = c1.b;
+
+			if(dxt == DXT5)
+			{
+				unsigned char ca0 = a0[l], ca1 = a1[l];
+				if(ca0 == ca1)
+				{
+					if(ca0 == 255)
+						--ca1;
+					else
+						++ca1;
+				}
+				if(refine == REFINE_NEVER || !lossy[l])
+					if(ca1 < ca0)
+						swap(ca0, ca1);
+				a0[l] = ca0;
+				a1[l] = ca1;
+			}
+		}
+
+		// pick the indices and collect the sums for refinement
+		uint32_t cbits[lanes];
+		uint64_t abits[lanes];
+		int n0[lanes], n1[lanes];
+		int s0r[lanes], s0g[lanes], s0b[lanes];
+		int s1r[lanes], s1g[lanes], s1b[lanes];
+		int an0[lanes], an1[lanes], as0[lanes], as1[lanes];
+		for(l = 0; l < lanes; ++l)
+		{
+			cbits[l] = 0;
+			abits[l] = 0;
+			n0[l] = n1[l] = 0;
+			s0r[l] = s0g[l] = s0b[l] = 0;
+			s1r[l] = s1g[l] = s1b[l] = 0;
+			an0[l] = an1[l] = as0[l] = as1[l] = 0;
+		}
+		for(i = 0; i < 16; ++i)
+		{
+			for(l = 0; l < lanes; ++l)
+			{
+				color_t c = make_color_t(r[i][l], g[i][l], b[i][l]);
+				int d0 = ColorDist(c, make_color_t(c0r[l], c0g[l], c0b[l]));
+				int d1 = ColorDist(c, make_color_t(c1r[l], c1g[l], c1b[l]));
+				int best = d1 < d0;
+				int trans = have_trans ? (a[i][l] == 0) : 0;
+				cbits[l] |= (uint32_t) (best | (trans * 3)) << (2 * i);
+				if(refine == REFINE_ALWAYS)
+				{
+					int in0 = -((best | trans) ^ 1);
+					int in1 = -(best & (trans ^ 1));
+					n0[l] -= in0;
+					s0r[l] += r[i][l] & in0;
+					s0g[l] += g[i][l] & in0;
+					s0b[l] += b[i][l] & in0;
+					n1[l] -= in1;
+					s1r[l] += r[i][l] & in1;
+					s1g[l] += g[i][l] & in1;
+					s1b[l] += b[i][l] & in1;
+				}
+
+				if(dxt == DXT3)
+					abits[l] |= (uint64_t) a[i][l] << (4 * i);
+				if(dxt == DXT5)
+				{
+					int av = a[i][l];
+					int e0 = alpha_dist(av, a0[l]);
+					int e1 = alpha_dist(av, a1[l]);
+					int abest = e1 < e0;
+					int bestdist = abest ? e1 : e0;
+					int is0 = alpha_dist(av, 0) <= bestdist;
+					int is255 = (is0 ^ 1) & (alpha_dist(av, 255) <= bestdist);
+					int inner = (is0 | is255) ^ 1;
+					abits[l] |= (uint64_t) ((abest & inner) | (is0 * 6) | (is255 * 7)) << (3 * i);
+					if(refine == REFINE_ALWAYS)
+					{
+						int in0 = -(inner & (abest ^ 1));
+						int in1 = -(inner & abest);
+						an0[l] -= in0;
+						as0[l] += av & in0;
+						an1[l] -= in1;
+						as1[l] += av & in1;
+					}
+				}
+			}
+		}
+
+		// refine and write out each block
+		for(l = 0; l < lanes; ++l, out += blocksize)
+		{
+			color_t c0 = make_color_t(c0r[l], c0g[l], c0b[l]);
+			color_t c1 = make_color_t(c1r[l], c1g[l], c1b[l]);
+			bitarray<uint32_t, 16, 2> colorblock;
+			colorblock.setbits(cbits[l]);
+			if(refine == REFINE_ALWAYS && lossy[l])
+			{
+				s2tc_evaluate_colors_result_t<color_t, bigcolor_t, 1> res;
+				res.n0 = n0[l];
+				res.n1 = n1[l];
+				res.S0.r = s0r[l];
+				res.S0.g = s0g[l];
+				res.S0.b = s0b[l];
+				res.S1.r = s1r[l];
+				res.S1.g = s1g[l];
+				res.S1.b = s1b[l];
+				res.evaluate(c0, c1);
+				s2tc_dxt1_color_fixup<have_trans>(colorblock, c0, c1);
+			}
+			unsigned char *cout = (dxt == DXT1) ? out : out + 8;
+			cout[0] = ((c0.g & 0x07) << 5) | c0.b;
+			cout[1] = (c0.r << 3) | (c0.g >> 3);
+			cout[2] = ((c1.g & 0x07) << 5) | c1.b;
+			cout[3] = (c1.r << 3) | (c1.g >> 3);
+			colorblock.tobytes(&cout[4]);
+
+			if(dxt == DXT3)
+			{
+				bitarray<uint64_t, 16, 4> alphablock;
+				alphablock.setbits(abits[l]);
+				alphablock.tobytes(&out[0]);
+			}
+			if(dxt == DXT5)
+			{
+				unsigned char ca0 = a0[l], ca1 = a1[l];
+				bitarray<uint64_t, 16, 3> alphablock;
+				alphablock.setbits(abits[l]);
+				if(refine == REFINE_ALWAYS && lossy[l])
+				{
+					s2tc_evaluate_colors_result_t<unsigned char, int, 1> res;
+					res.n0 = an0[l];
+					res.n1 = an1[l];
+					res.S0 = as0[l];
+					res.S1 = as1[l];
+					res.evaluate(ca0, ca1);
+					s2tc_dxt5_alpha_fixup(alphablock, ca0, ca1);
+				}
+				out[0] = ca0;
+				out[1] = ca1;
+				alphablock.tobytes(&out[2]);
+			}
+		}
+	}
+
+	template<DxtMode dxt, ColorDistFunc ColorDist, RefinementMode refine, int lanes>
+	inline S2TC_ALWAYS_INLINE void s2tc_encode_blocks(unsigned char *out, const unsigned char *rgba, int iw, int nblocks)
+	{
+		const int blocksize = (dxt == DXT1) ? 8 : 16;
+		for(; nblocks >= lanes; nblocks -= lanes)
+		{
+			s2tc_encode_lanes<dxt, ColorDist, refine, lanes>(out, rgba, iw);
+			out += lanes * blocksize;
+			rgba += lanes * 16;
+		}
+		for(; nblocks > 0; --nblocks)
+		{
+			s2tc_encode_block<dxt, ColorDist, MODE_FAST, refine, true>(out, rgba, iw, 4, 4, -1, NULL, 0);
+			out += blocksize;
+			rgba += 16;
+		}
+	}
+
+	// one instance per instruction set, picked at runtime; the lane count
+	// grows with the vector width; about four vectors of 32 bit lanes
+	// measured fastest for this engine
+	const int s2tc_lanes_generic = 16;
+	const int s2tc_lanes_avx2 = 32;
+	const int s2tc_lanes_avx512 = 64;
+
+	template<DxtMode dxt, ColorDistFunc ColorDist, RefinementMode refine>
+	void s2tc_encode_blocks_generic(unsigned char *out, const unsigned char *rgba, int iw, int nblocks)
+	{
+		s2tc_encode_blocks<dxt, ColorDist, refine, s2tc_lanes_generic>(out, rgba, iw, nblocks);
+	}
+#ifdef S2TC_X86_TARGETS
+	template<DxtMode dxt, ColorDistFunc ColorDist, RefinementMode refine>
+	S2TC_TARGET("avx2") void s2tc_encode_blocks_avx2(unsigned char *out, const unsigned char *rgba, int iw, int nblocks)
+	{
+		s2tc_encode_blocks<dxt, ColorDist, refine, s2tc_lanes_avx2>(out, rgba, iw, nblocks);
+	}
+	template<DxtMode dxt, ColorDistFunc ColorDist, RefinementMode refine>
+	S2TC_TARGET_AVX512 void s2tc_encode_blocks_avx512(unsigned char *out, const unsigned char *rgba, int iw, int nblocks)
+	{
+		s2tc_encode_blocks<dxt, ColorDist, refine, s2tc_lanes_avx512>(out, rgba, iw, nblocks);
+	}
+#endif
+
+	// realtime engine: works on the unconverted 8 bit source pixels, picks
+	// inset bounding box endpoints and assigns indices by projecting onto
+	// the endpoint axis, all in one branch free pass per block
+	inline int s2tc_realtime_quantize(int v, int maxval)
+	{
+		return (v * maxval + 127) / 255;
+	}
+
+	template<DxtMode dxt, int srccomps, bool bgr, int lanes>
+	inline S2TC_ALWAYS_INLINE void s2tc_encode_lanes_realtime(unsigned char *out, const unsigned char *src, int stride)
+	{
+		const bool have_trans = (dxt == DXT1) && (srccomps == 4);
+		const int blocksize = (dxt == DXT1) ? 8 : 16;
+		int r[16][lanes], g[16][lanes], b[16][lanes], a[16][lanes];
+		int use[16][lanes];
+		int rmin[lanes], gmin[lanes], bmin[lanes], amin[lanes];
+		int rmax[lanes], gmax[lanes], bmax[lanes], amax[lanes];
+		int i, l;
+
+		for(i = 0; i < 16; ++i)
+		{
+			const unsigned char *pix = &src[(i >> 2) * stride + (i & 3) * srccomps];
+			for(l = 0; l < lanes; ++l)
+			{
+				r[i][l] = pix[l * 4 * srccomps + (bgr ? 2 : 0)];
+				g[i][l] = pix[l * 4 * srccomps + 1];
+				b[i][l] = pix[l * 4 * srccomps + (bgr ? 0 : 2)];
+				a[i][l] = (srccomps == 4) ? pix[l * 4 * srccomps + 3] : 255;
+			}
+		}
+
+		// bounding box of the opaque pixels
+		for(l = 0; l < lanes; ++l)
+		{
+			rmin[l] = gmin[l] = bmin[l] = amin[l] = 255;
+			rmax[l] = gmax[l] = bmax[l] = amax[l] = 0;
+		}
+		for(i = 0; i < 16; ++i)
+		{
+			for(l = 0; l < lanes; ++l)
+			{
+				int u = have_trans ? -(a[i][l] >= 128) : -1;
+				use[i][l] = u;
+				// masked out pixels count as 255 for the minimum, not as -1
+				rmin[l] = min(rmin[l], r[i][l] | (~u & 255));
+				gmin[l] = min(gmin[l], g[i][l] | (~u & 255));
+				bmin[l] = min(bmin[l], b[i][l] | (~u & 255));
+				rmax[l] = max(rmax[l], r[i][l] & u);
+				gmax[l] = max(gmax[l], g[i][l] & u);
+				bmax[l] = max(bmax[l], b[i][l] & u);
+				if(dxt == DXT5)
+				{
+					// 0 and 255 have their own indices
+					int counted = -((a[i][l] != 0) & (a[i][l] != 255));
+					amin[l] = min(amin[l], a[i][l] | (~counted & 255));
+					amax[l] = max(amax[l], a[i][l] & counted);
+				}
+			}
+		}
+
+		// pick the bounding box diagonal that follows the sign of the
+		// red/green and blue/green covariance, then inset by a quarter of
+		// the range, which is where two levels best represent a span
+		int c0r[lanes], c0g[lanes], c0b[lanes];
+		int c1r[lanes], c1g[lanes], c1b[lanes];
+		{
+			int covrg[lanes], covbg[lanes];
+			for(l = 0; l < lanes; ++l)
+				covrg[l] = covbg[l] = 0;
+			for(i = 0; i < 16; ++i)
+			{
+				for(l = 0; l < lanes; ++l)
+				{
+					int dg = (2 * g[i][l] - gmin[l] - gmax[l]) & use[i][l];
+					covrg[l] += (2 * r[i][l] - rmin[l] - rmax[l]) * dg;
+					covbg[l] += (2 * b[i][l] - bmin[l] - bmax[l]) * dg;
+				}
+			}
+			for(l = 0; l < lanes; ++l)
+			{
+				// an all transparent block leaves the box inverted
+				int empty = -(rmin[l] > rmax[l]);
+				rmin[l] &= ~empty;
+				gmin[l] &= ~empty;
+				bmin[l] &= ~empty;
+				int fliprg = -(covrg[l] < 0);
+				int flipbg = -(covbg[l] < 0);
+				int r0 = (rmin[l] & ~fliprg) | (rmax[l] & fliprg);
+				int r1 = (rmax[l] & ~fliprg) | (rmin[l] & fliprg);
+				int b0 = (bmin[l] & ~flipbg) | (bmax[l] & flipbg);
+				int b1 = (bmax[l] & ~flipbg) | (bmin[l] & flipbg);
+				int g0 = gmin[l], g1 = gmax[l];
+				int ir = (r1 - r0) / 4, ig = (g1 - g0) / 4, ib = (b1 - b0) / 4;
+				c0r[l] = s2tc_realtime_quantize(r0 + ir, 31);
+				c0g[l] = s2tc_realtime_quantize(g0 + ig, 63);
+				c0b[l] = s2tc_realtime_quantize(b0 + ib, 31);
+				c1r[l] = s2tc_realtime_quantize(r1 - ir, 31);
+				c1g[l] = s2tc_realtime_quantize(g1 - ig, 63);
+				c1b[l] = s2tc_realtime_quantize(b1 - ib, 31);
+			}
+		}
+
+		// endpoint order: c0 <= c1 for DXT1, c0 > c1 otherwise, never equal
+		int p0[lanes], p1[lanes];
+		int a0[lanes], a1[lanes];
+		for(l = 0; l < lanes; ++l)
+		{
+			int q0 = (c0r[l] << 11) | (c0g[l] << 5) | c0b[l];
+			int q1 = (c1r[l] << 11) | (c1g[l] << 5) | c1b[l];
+			int lo = min(q0, q1), hi = max(q0, q1);
+			int same = -(lo == hi);
+			int top = -(hi == 0xFFFF);
+			lo -= same & top & 1;
+			hi += same & ~top & 1;
+			p0[l] = (dxt == DXT1) ? lo : hi;
+			p1[l] = (dxt == DXT1) ? hi : lo;
+
+			if(dxt == DXT5)
+			{
+				int al = amin[l], ah = amax[l];
+				int none = -(al > ah);
+				al &= ~none;
+				ah &= ~none;
+				int ia = (ah - al) / 4;
+				al += ia;
+				ah -= ia;
+				int asame = -(al == ah);
+				int atop = -(ah == 255);
+				al -= asame & atop & 1;
+				ah += asame & ~atop & 1;
+				a0[l] = al;
+				a1[l] = ah;
+			}
+		}
+
+		// one projection pass for the indices
+		uint32_t cbits[lanes];
+		uint64_t abits[lanes];
+		{
+			int er0[lanes], eg0[lanes], eb0[lanes];
+			int dr[lanes], dg[lanes], db[lanes], mid[lanes];
+			for(l = 0; l < lanes; ++l)
+			{
+				int r5 = p0[l] >> 11, g6 = (p0[l] >> 5) & 0x3F, b5 = p0[l] & 0x1F;
+				er0[l] = (r5 << 3) | (r5 >> 2);
+				eg0[l] = (g6 << 2) | (g6 >> 4);
+				eb0[l] = (b5 << 3) | (b5 >> 2);
+				r5 = p1[l] >> 11;
+				g6 = (p1[l] >> 5) & 0x3F;
+				b5 = p1[l] & 0x1F;
+				dr[l] = ((r5 << 3) | (r5 >> 2)) - er0[l];
+				dg[l] = ((g6 << 2) | (g6 >> 4)) - eg0[l];
+				db[l] = ((b5 << 3) | (b5 >> 2)) - eb0[l];
+				mid[l] = dr[l] * dr[l] + dg[l] * dg[l] + db[l] * db[l];
+				cbits[l] = 0;
+				abits[l] = 0;
+			}
+			for(i = 0; i < 16; ++i)
+			{
+				for(l = 0; l < lanes; ++l)
+				{
+					int t = (r[i][l] - er0[l]) * dr[l] + (g[i][l] - eg0[l]) * dg[l] + (b[i][l] - eb0[l]) * db[l];
+					int idx = (2 * t > mid[l]) | (~use[i][l] & 3);
+					cbits[l] |= (uint32_t) idx << (2 * i);
+					if(dxt == DXT3)
+						abits[l] |= (uint64_t) (a[i][l] >> 4) << (4 * i);
+					if(dxt == DXT5)
+					{
+						int av = a[i][l];
+						int e0 = alpha_dist(av, a0[l]);
+						int e1 = alpha_dist(av, a1[l]);
+						int abest = e1 < e0;
+						int bestdist = min(e0, e1);
+						int is0 = alpha_dist(av, 0) <= bestdist;
+						int is255 = (is0 ^ 1) & (alpha_dist(av, 255) <= bestdist);
+						int inner = (is0 | is255) ^ 1;
+						abits[l] |= (uint64_t) ((abest & inner) | (is0 * 6) | (is255 * 7)) << (3 * i);
+					}
+				}
+			}
+		}
+
+		for(l = 0; l < lanes; ++l, out += blocksize)
+		{
+			unsigned char *cout = (dxt == DXT1) ? out : out + 8;
+			cout[0] = p0[l] & 0xFF;
+			cout[1] = p0[l] >> 8;
+			cout[2] = p1[l] & 0xFF;
+			cout[3] = p1[l] >> 8;
+			bitarray<uint32_t, 16, 2> colorblock;
+			colorblock.setbits(cbits[l]);
+			colorblock.tobytes(&cout[4]);
+			if(dxt == DXT3)
+			{
+				bitarray<uint64_t, 16, 4> alphablock;
+				alphablock.setbits(abits[l]);
+				alphablock.tobytes(&out[0]);
+			}
+			if(dxt == DXT5)
+			{
+				bitarray<uint64_t, 16, 3> alphablock;
+				alphablock.setbits(abits[l]);
+				out[0] = a0[l];
+				out[1] = a1[l];
+				alphablock.tobytes(&out[2]);
 			}
+		}
+	}
 
-			reduce_colors_inplace(c, n, m, ColorDist);
-			if(dxt == DXT5)
-				reduce_colors_inplace_2fixpoints(ca, n, m, alpha_dist, (unsigned char) 0, (unsigned char) 255);
+	template<DxtMode dxt, int srccomps, bool bgr, int lanes>
+	inline S2TC_ALWAYS_INLINE void s2tc_encode_blocks_realtime(unsigned char *out, const unsigned char *src, int stride, int nblocks)
+	{
+		const int blocksize = (dxt == DXT1) ? 8 : 16;
+		for(; nblocks >= lanes; nblocks -= lanes)
+		{
+			s2tc_encode_lanes_realtime<dxt, srccomps, bgr, lanes>(out, src, stride);
+			out += lanes * blocksize;
+			src += lanes * 4 * srccomps;
+		}
+		for(; nblocks > 0; --nblocks)
+		{
+			s2tc_encode_lanes_realtime<dxt, srccomps, bgr, 1>(out, src, stride);
+			out += blocksize;
+			src += 4 * srccomps;
 		}
+	}
 
-		// equal colors are BAD
-		if(c[0] == c[1])
+	// the realtime engine keeps more state per lane, one vector of lanes
+	// measured fastest
+	const int s2tc_realtime_lanes_generic = 4;
+	const int s2tc_realtime_lanes_avx2 = 8;
+	const int s2tc_realtime_lanes_avx512 = 16;
+
+	template<DxtMode dxt, int srccomps, bool bgr>
+	void s2tc_encode_blocks_realtime_generic(unsigned char *out, const unsigned char *src, int stride, int nblocks)
+	{
+		s2tc_encode_blocks_realtime<dxt, srccomps, bgr, s2tc_realtime_lanes_generic>(out, src, stride, nblocks);
+	}
+#ifdef S2TC_X86_TARGETS
+	template<DxtMode dxt, int srccomps, bool bgr>
+	S2TC_TARGET("avx2") void s2tc_encode_blocks_realtime_avx2(unsigned char *out, const unsigned char *src, int stride, int nblocks)
+	{
+		s2tc_encode_blocks_realtime<dxt, srccomps, bgr, s2tc_realtime_lanes_avx2>(out, src, stride, nblocks);
+	}
+	template<DxtMode dxt, int srccomps, bool bgr>
+	S2TC_TARGET_AVX512 void s2tc_encode_blocks_realtime_avx512(unsigned char *out, const unsigned char *src, int stride, int nblocks)
+	{
+		s2tc_encode_blocks_realtime<dxt, srccomps, bgr, s2tc_realtime_lanes_avx512>(out, src, stride, nblocks);
+	}
+#endif
+
+	// decoded luminance of a 565 color
+	inline int s2tc_gray_of(int c)
+	{
+		int r = (c >> 11) & 0x1F, g = (c >> 5) & 0x3F, b = c & 0x1F;
+		r = (r << 3) | (r >> 2);
+		g = (g << 2) | (g >> 4);
+		b = (b << 3) | (b >> 2);
+		return (r * 77 + g * 150 + b * 29 + 128) >> 8;
+	}
+
+	// encoder for luminance (srccomps 1) and luminance-alpha (srccomps 2)
+	// input: the gray channel is quantized in one dimension and written as
+	// the nearest gray 565 endpoints
+	template<DxtMode dxt, int srccomps>
+	void s2tc_encode_gray_block(unsigned char *out, const unsigned char *src, int stride, int w, int h)
+	{
+		const bool have_trans = (dxt == DXT1) && (srccomps == 2);
+		int l[16], a[16], v[16], va[16];
+		int n = 0, na = 0;
+		int x, y, i;
+		unsigned int mask = 0;
+
+		for(y = 0; y < h; ++y)
+			for(x = 0; x < w; ++x)
+			{
+				i = y * 4 + x;
+				const unsigned char *pix = &src[y * stride + x * srccomps];
+				l[i] = pix[0];
+				a[i] = (srccomps == 2) ? pix[1] : 255;
+				mask |= 1u << i;
+				if(!have_trans || a[i] >= 128)
+					v[n++] = l[i];
+				if(dxt == DXT5 && a[i] != 0 && a[i] != 255)
+					va[na++] = a[i];
+			}
+
+		int m0, m1;
+		s2tc_sort(v, n);
+		s2tc_solve_1d(v, n, m0, m1);
+		int g0 = s2tc_realtime_quantize(m0, 63), g1 = s2tc_realtime_quantize(m1, 63);
+		if(g0 == g1)
 		{
-			if(c[0] == color_type_info<color_t>::max_value)
-				--c[1];
+			if(g1 == 63)
+				--g0;
 			else
-				++c[1];
+				++g1;
 		}
+		int c0 = (s2tc_realtime_quantize(m0, 31) << 11) | (g0 << 5) | s2tc_realtime_quantize(m0, 31);
+		int c1 = (s2tc_realtime_quantize(m1, 31) << 11) | (g1 << 5) | s2tc_realtime_quantize(m1, 31);
+		// g0 < g1, so c0 < c1; DXT3/5 need the other order
+		if(dxt != DXT1)
+			swap(c0, c1);
+		int e0 = s2tc_gray_of(c0), e1 = s2tc_gray_of(c1);
 
+		bitarray<uint32_t, 16, 2> colorblock;
+		for(i = 0; i < 16; ++i)
+		{
+			if(!(mask & (1u << i)))
+				continue;
+			if(have_trans && a[i] < 128)
+				colorblock.set(i, 3);
+			else
+				colorblock.set(i, abs(l[i] - e1) < abs(l[i] - e0));
+		}
+		unsigned char *cout = (dxt == DXT1) ? out : out + 8;
+		cout[0] = c0 & 0xFF;
+		cout[1] = c0 >> 8;
+		cout[2] = c1 & 0xFF;
+		cout[3] = c1 >> 8;
+		colorblock.tobytes(&cout[4]);
+
+		if(dxt == DXT3)
+		{
+			bitarray<uint64_t, 16, 4> alphablock;
+			for(i = 0; i < 16; ++i)
+				if(mask & (1u << i))
+					alphablock.set(i, a[i] >> 4);
+			alphablock.tobytes(&out[0]);
+		}
 		if(dxt == DXT5)
 		{
-			if(ca[0] == ca[1])
+			int ma0, ma1;
+			s2tc_sort(va, na);
+			s2tc_solve_1d(va, na, ma0, ma1);
+			if(ma0 == ma1)
 			{
-				if(ca[0] == 255)
-					--ca[1];
+				if(ma1 == 255)
+					--ma0;
 				else
-					++ca[1];
+					++ma1;
 			}
-		}
-
-		switch(dxt)
-		{
-			case DXT1:
-				{
-					bitarray<uint32_t, 16, 2> colorblock;
-					switch(refine)
-					{
-						case REFINE_NEVER:
-							s2tc_dxt1_encode_color_refine_never<ColorDist, true>(colorblock, rgba, iw, w, h, c[0], c[1]);
-							break;
-						case REFINE_ALWAYS:
-							s2tc_dxt1_encode_color_refine_always<ColorDist, true>(colorblock, rgba, iw, w, h, c[0], c[1]);
-							break;
-						case REFINE_LOOP:
-							s2tc_dxt1_encode_color_refine_loop<ColorDist, true>(colorblock, rgba, iw, w, h, c[0], c[1]);
-							break;
-					}
-					out[0] = ((c[0].g & 0x07) << 5) | c[0].b;
-					out[1] = (c[0].r << 3) | (c[0].g >> 3);
-					out[2] = ((c[1].g & 0x07) << 5) | c[1].b;
-					out[3] = (c[1].r << 3) | (c[1].g >> 3);
-					colorblock.tobytes(&out[4]);
-				}
-				break;
-			case DXT3:
-				{
-					bitarray<uint32_t, 16, 2> colorblock;
-					bitarray<uint64_t, 16, 4> alphablock;
-					switch(refine)
-					{
-						case REFINE_NEVER:
-							s2tc_dxt1_encode_color_refine_never<ColorDist, false>(colorblock, rgba, iw, w, h, c[0], c[1]);
-							break;
-						case REFINE_ALWAYS:
-							s2tc_dxt1_encode_color_refine_always<ColorDist, false>(colorblock, rgba, iw, w, h, c[0], c[1]);
-							break;
-						case REFINE_LOOP:
-							s2tc_dxt1_encode_color_refine_loop<ColorDist, false>(colorblock, rgba, iw, w, h, c[0], c[1]);
-							break;
-					}
-					s2tc_dxt3_encode_alpha(alphablock, rgba, iw, w, h);
-					alphablock.tobytes(&out[0]);
-					out[8] = ((c[0].g & 0x07) << 5) | c[0].b;
-					out[9] = (c[0].r << 3) | (c[0].g >> 3);
-					out[10] = ((c[1].g & 0x07) << 5) | c[1].b;
-					out[11] = (c[1].r << 3) | (c[1].g >> 3);
-					colorblock.tobytes(&out[12]);
-				}
-				break;
-			case DXT5:
-				{
-					bitarray<uint32_t, 16, 2> colorblock;
-					bitarray<uint64_t, 16, 3> alphablock;
-					switch(refine)
-					{
-						case REFINE_NEVER:
-							s2tc_dxt1_encode_color_refine_never<ColorDist, false>(colorblock, rgba, iw, w, h, c[0], c[1]);
-							s2tc_dxt5_encode_alpha_refine_never(alphablock, rgba, iw, w, h, ca[0], ca[1]);
-							break;
-						case REFINE_ALWAYS:
-							s2tc_dxt1_encode_color_refine_always<ColorDist, false>(colorblock, rgba, iw, w, h, c[0], c[1]);
-							s2tc_dxt5_encode_alpha_refine_always(alphablock, rgba, iw, w, h, ca[0], ca[1]);
-							break;
-						case REFINE_LOOP:
-							s2tc_dxt1_encode_color_refine_loop<ColorDist, false>(colorblock, rgba, iw, w, h, c[0], c[1]);
-							s2tc_dxt5_encode_alpha_refine_loop(alphablock, rgba, iw, w, h, ca[0], ca[1]);
-							break;
-					}
-					out[0] = ca[0];
-					out[1] = ca[1];
-					alphablock.tobytes(&out[2]);
-					out[8] = ((c[0].g & 0x07) << 5) | c[0].b;
-					out[9] = (c[0].r << 3) | (c[0].g >> 3);
-					out[10] = ((c[1].g & 0x07) << 5) | c[1].b;
-					out[11] = (c[1].r << 3) | (c[1].g >> 3);
-					colorblock.tobytes(&out[12]);
-				}
-				break;
+			bitarray<uint64_t, 16, 3> alphablock;
+			for(i = 0; i < 16; ++i)
+			{
+				if(!(mask & (1u << i)))
+					continue;
+				int d0 = alpha_dist(a[i], ma0);
+				int d1 = alpha_dist(a[i], ma1);
+				int bestdist = min(d0, d1);
+				if(alpha_dist(a[i], 0) <= bestdist)
+					alphablock.set(i, 6);
+				else if(alpha_dist(a[i], 255) <= bestdist)
+					alphablock.set(i, 7);
+				else
+					alphablock.set(i, d1 < d0);
+			}
+			out[0] = ma0;
+			out[1] = ma1;
+			alphablock.tobytes(&out[2]);
 		}
 	}
 
 	// compile time dispatch magic
-	template<DxtMode dxt, ColorDistFunc ColorDist, CompressionMode mode>
+	template<DxtMode dxt, ColorDistFunc ColorDist, CompressionMode mode, bool full>
 	inline s2tc_encode_block_func_t s2tc_encode_block_func(RefinementMode refine)
 	{
 		switch(refine)
 		{
 			case REFINE_NEVER:
-				return s2tc_encode_block<dxt, ColorDist, mode, REFINE_NEVER>;
+				return s2tc_encode_block<dxt, ColorDist, mode, REFINE_NEVER, full>;
 			case REFINE_LOOP:
-				return s2tc_encode_block<dxt, ColorDist, mode, REFINE_LOOP>;
+				return s2tc_encode_block<dxt, ColorDist, mode, REFINE_LOOP, full>;
 			default:
 			case REFINE_ALWAYS:
-				return s2tc_encode_block<dxt, ColorDist, mode, REFINE_ALWAYS>;
+				return s2tc_encode_block<dxt, ColorDist, mode, REFINE_ALWAYS, full>;
 		}
 	}
 
@@ -1133,63 +2275,274 @@ namespace
 		static const bool value = false;
 	};
 
-	template<DxtMode dxt, ColorDistFunc ColorDist>
+	template<DxtMode dxt, ColorDistFunc ColorDist, bool full>
 	inline s2tc_encode_block_func_t s2tc_encode_block_func(int nrandom, RefinementMode refine)
 	{
 		if(!supports_fast<ColorDist>::value || nrandom >= 0)
-			return s2tc_encode_block_func<dxt, ColorDist, MODE_NORMAL>(refine);
+			return s2tc_encode_block_func<dxt, ColorDist, MODE_NORMAL, full>(refine);
 		else
-			return s2tc_encode_block_func<dxt, ColorDist, MODE_FAST>(refine);
+			return s2tc_encode_block_func<dxt, ColorDist, MODE_FAST, full>(refine);
 	}
 
-	template<ColorDistFunc ColorDist>
+	template<ColorDistFunc ColorDist, bool full>
 	inline s2tc_encode_block_func_t s2tc_encode_block_func(DxtMode dxt, int nrandom, RefinementMode refine)
 	{
 		switch(dxt)
 		{
 			case DXT1:
-				return s2tc_encode_block_func<DXT1, ColorDist>(nrandom, refine);
+				return s2tc_encode_block_func<DXT1, ColorDist, full>(nrandom, refine);
 				break;
 			case DXT3:
-				return s2tc_encode_block_func<DXT3, ColorDist>(nrandom, refine);
+				return s2tc_encode_block_func<DXT3, ColorDist, full>(nrandom, refine);
+				break;
+			default:
+			case DXT5:
+				return s2tc_encode_block_func<DXT5, ColorDist, full>(nrandom, refine);
 				break;
+		}
+	}
+
+	template<DxtMode dxt, ColorDistFunc ColorDist, RefinementMode refine>
+	inline s2tc_encode_blocks_func_t s2tc_encode_blocks_func()
+	{
+#ifdef S2TC_X86_TARGETS
+		__builtin_cpu_init();
+		if(__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw"))
+			return s2tc_encode_blocks_avx512<dxt, ColorDist, refine>;
+		if(__builtin_cpu_supports("avx2"))
+			return s2tc_encode_blocks_avx2<dxt, ColorDist, refine>;
+#endif
+		return s2tc_encode_blocks_generic<dxt, ColorDist, refine>;
+	}
+
+	template<DxtMode dxt, ColorDistFunc ColorDist>
+	inline s2tc_encode_blocks_func_t s2tc_encode_blocks_func(int nrandom, RefinementMode refine)
+	{
+		if(!supports_fast<ColorDist>::value || nrandom >= 0)
+			return NULL;
+		switch(refine)
+		{
+			case REFINE_NEVER:
+				return s2tc_encode_blocks_func<dxt, ColorDist, REFINE_NEVER>();
+			case REFINE_ALWAYS:
+				return s2tc_encode_blocks_func<dxt, ColorDist, REFINE_ALWAYS>();
+			default:
+				return NULL;
+		}
+	}
+
+	template<ColorDistFunc ColorDist>
+	inline s2tc_encode_blocks_func_t s2tc_encode_blocks_func(DxtMode dxt, int nrandom, RefinementMode refine)
+	{
+		switch(dxt)
+		{
+			case DXT1:
+				return s2tc_encode_blocks_func<DXT1, ColorDist>(nrandom, refine);
+			case DXT3:
+				return s2tc_encode_blocks_func<DXT3, ColorDist>(nrandom, refine);
 			default:
 			case DXT5:
-				return s2tc_encode_block_func<DXT5, ColorDist>(nrandom, refine);
+				return s2tc_encode_blocks_func<DXT5, ColorDist>(nrandom, refine);
+		}
+	}
+
+	template<bool full>
+	inline s2tc_encode_block_func_t s2tc_encode_block_func(DxtMode dxt, ColorDistMode cd, int nrandom, RefinementMode refine)
+	{
+		switch(cd)
+		{
+			case RGB:
+				return s2tc_encode_block_func<color_dist_rgb, full>(dxt, nrandom, refine);
+				break;
+			case YUV:
+				return s2tc_encode_block_func<color_dist_yuv, full>(dxt, nrandom, refine);
+				break;
+			case SRGB:
+				return s2tc_encode_block_func<color_dist_srgb, full>(dxt, nrandom, refine);
+				break;
+			case SRGB_MIXED:
+				return s2tc_encode_block_func<color_dist_srgb_mixed, full>(dxt, nrandom, refine);
+				break;
+			case AVG:
+				return s2tc_encode_block_func<color_dist_avg, full>(dxt, nrandom, refine);
+				break;
+			default:
+			case WAVG:
+				return s2tc_encode_block_func<color_dist_wavg, full>(dxt, nrandom, refine);
+				break;
+			case W0AVG:
+				return s2tc_encode_block_func<color_dist_w0avg, full>(dxt, nrandom, refine);
+				break;
+			case NORMALMAP:
+				return s2tc_encode_block_func<color_dist_normalmap, full>(dxt, nrandom, refine);
 				break;
 		}
 	}
 };
 
-s2tc_encode_block_func_t s2tc_encode_block_func(DxtMode dxt, ColorDistMode cd, int nrandom, RefinementMode refine)
+s2tc_encode_block_func_t s2tc_encode_block_func(DxtMode dxt, ColorDistMode cd, int nrandom, RefinementMode refine, int full)
+{
+	if(full)
+		return s2tc_encode_block_func<true>(dxt, cd, nrandom, refine);
+	else
+		return s2tc_encode_block_func<false>(dxt, cd, nrandom, refine);
+}
+
+s2tc_encode_blocks_func_t s2tc_encode_blocks_func(DxtMode dxt, ColorDistMode cd, int nrandom, RefinementMode refine)
 {
 	switch(cd)
 	{
 		case RGB:
-			return s2tc_encode_block_func<color_dist_rgb>(dxt, nrandom, refine);
-			break;
+			return s2tc_encode_blocks_func<color_dist_rgb>(dxt, nrandom, refine);
 		case YUV:
-			return s2tc_encode_block_func<color_dist_yuv>(dxt, nrandom, refine);
-			break;
+			return s2tc_encode_blocks_func<color_dist_yuv>(dxt, nrandom, refine);
 		case SRGB:
-			return s2tc_encode_block_func<color_dist_srgb>(dxt, nrandom, refine);
-			break;
+			return s2tc_encode_blocks_func<color_dist_srgb>(dxt, nrandom, refine);
 		case SRGB_MIXED:
-			return s2tc_encode_block_func<color_dist_srgb_mixed>(dxt, nrandom, refine);
-			break;
+			return s2tc_encode_blocks_func<color_dist_srgb_mixed>(dxt, nrandom, refine);
 		case AVG:
-			return s2tc_encode_block_func<color_dist_avg>(dxt, nrandom, refine);
-			break;
+			return s2tc_encode_blocks_func<color_dist_avg>(dxt, nrandom, refine);
 		default:
 		case WAVG:
-			return s2tc_encode_block_func<color_dist_wavg>(dxt, nrandom, refine);
-			break;
+			return s2tc_encode_blocks_func<color_dist_wavg>(dxt, nrandom, refine);
 		case W0AVG:
-			return s2tc_encode_block_func<color_dist_w0avg>(dxt, nrandom, refine);
-			break;
+			return s2tc_encode_blocks_func<color_dist_w0avg>(dxt, nrandom, refine);
 		case NORMALMAP:
-			return s2tc_encode_block_func<color_dist_normalmap>(dxt, nrandom, refine);
-			break;
+			return NULL;
+	}
+}
+
+namespace
+{
+	template<DxtMode dxt, int srccomps, bool bgr>
+	inline s2tc_encode_blocks_realtime_func_t s2tc_encode_blocks_realtime_func()
+	{
+#ifdef S2TC_X86_TARGETS
+		__builtin_cpu_init();
+		if(__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw"))
+			return s2tc_encode_blocks_realtime_avx512<dxt, srccomps, bgr>;
+		if(__builtin_cpu_supports("avx2"))
+			return s2tc_encode_blocks_realtime_avx2<dxt, srccomps, bgr>;
+#endif
+		return s2tc_encode_blocks_realtime_generic<dxt, srccomps, bgr>;
+	}
+
+	template<int srccomps, bool bgr>
+	inline s2tc_encode_blocks_realtime_func_t s2tc_encode_blocks_realtime_func(DxtMode dxt)
+	{
+		switch(dxt)
+		{
+			case DXT1:
+				return s2tc_encode_blocks_realtime_func<DXT1, srccomps, bgr>();
+			case DXT3:
+				return s2tc_encode_blocks_realtime_func<DXT3, srccomps, bgr>();
+			default:
+			case DXT5:
+				return s2tc_encode_blocks_realtime_func<DXT5, srccomps, bgr>();
+		}
+	}
+};
+
+s2tc_encode_blocks_realtime_func_t s2tc_encode_blocks_realtime_func(DxtMode dxt, int srccomps, int bgr)
+{
+	switch(srccomps)
+	{
+		case 3:
+			if(bgr)
+				return s2tc_encode_blocks_realtime_func<3, true>(dxt);
+			return s2tc_encode_blocks_realtime_func<3, false>(dxt);
+		case 4:
+		default:
+			if(bgr)
+				return s2tc_encode_blocks_realtime_func<4, true>(dxt);
+			return s2tc_encode_blocks_realtime_func<4, false>(dxt);
+	}
+}
+
+namespace
+{
+	template<DxtMode dxt, ColorDistFunc ColorDist>
+	inline s2tc_transcode_blocks_func_t s2tc_transcode_blocks_func(RefinementMode refine)
+	{
+		switch(refine)
+		{
+			case REFINE_NEVER:
+				return s2tc_transcode_blocks<dxt, ColorDist, REFINE_NEVER>;
+			case REFINE_LOOP:
+				return s2tc_transcode_blocks<dxt, ColorDist, REFINE_LOOP>;
+			default:
+			case REFINE_ALWAYS:
+				return s2tc_transcode_blocks<dxt, ColorDist, REFINE_ALWAYS>;
+		}
+	}
+
+	template<ColorDistFunc ColorDist>
+	inline s2tc_transcode_blocks_func_t s2tc_transcode_blocks_func(DxtMode dxt, RefinementMode refine)
+	{
+		switch(dxt)
+		{
+			case DXT1:
+				return s2tc_transcode_blocks_func<DXT1, ColorDist>(refine);
+			case DXT3:
+				return s2tc_transcode_blocks_func<DXT3, ColorDist>(refine);
+			default:
+			case DXT5:
+				return s2tc_transcode_blocks_func<DXT5, ColorDist>(refine);
+		}
+	}
+};
+
+s2tc_transcode_blocks_func_t s2tc_transcode_blocks_func(DxtMode dxt, ColorDistMode cd, RefinementMode refine)
+{
+	switch(cd)
+	{
+		case RGB:
+			return s2tc_transcode_blocks_func<color_dist_rgb>(dxt, refine);
+		case YUV:
+			return s2tc_transcode_blocks_func<color_dist_yuv>(dxt, refine);
+		case SRGB:
+			return s2tc_transcode_blocks_func<color_dist_srgb>(dxt, refine);
+		case SRGB_MIXED:
+			return s2tc_transcode_blocks_func<color_dist_srgb_mixed>(dxt, refine);
+		case AVG:
+			return s2tc_transcode_blocks_func<color_dist_avg>(dxt, refine);
+		default:
+		case WAVG:
+			return s2tc_transcode_blocks_func<color_dist_wavg>(dxt, refine);
+		case W0AVG:
+			return s2tc_transcode_blocks_func<color_dist_w0avg>(dxt, refine);
+		case NORMALMAP:
+			return s2tc_transcode_blocks_func<color_dist_normalmap>(dxt, refine);
+	}
+}
+
+namespace
+{
+	template<int srccomps>
+	inline s2tc_encode_gray_block_func_t s2tc_encode_gray_block_func(DxtMode dxt)
+	{
+		switch(dxt)
+		{
+			case DXT1:
+				return s2tc_encode_gray_block<DXT1, srccomps>;
+			case DXT3:
+				return s2tc_encode_gray_block<DXT3, srccomps>;
+			default:
+			case DXT5:
+				return s2tc_encode_gray_block<DXT5, srccomps>;
+		}
+	}
+};
+
+s2tc_encode_gray_block_func_t s2tc_encode_gray_block_func(DxtMode dxt, int srccomps)
+{
+	switch(srccomps)
+	{
+		case 1:
+			return s2tc_encode_gray_block_func<1>(dxt);
+		case 2:
+		default:
+			return s2tc_encode_gray_block_func<2>(dxt);
 	}
 }
 
@@ -1260,9 +2613,12 @@ namespace
 		return ret;
 	}
 
-	template<int srccomps, int alphabits, DitherMode dither>
-	inline void rgb565_image(unsigned char *out, const unsigned char *rgba, int w, int h)
+	// stride: source row length in bytes; bgr: red and blue are swapped in the source
+	template<int srccomps, bool bgr, int alphabits, DitherMode dither>
+	inline void rgb565_image(unsigned char *out, const unsigned char *rgba, int w, int h, int stride)
 	{
+		const int ri = bgr ? 2 : 0;
+		const int bi = bgr ? 0 : 2;
 		int x, y;
 		switch(dither)
 		{
@@ -1271,9 +2627,9 @@ namespace
 					for(y = 0; y < h; ++y)
 						for(x = 0; x < w; ++x)
 						{
-							out[(x + y * w) * 4 + 0] = rgba[(x + y * w) * srccomps + 0] >> 3;
-							out[(x + y * w) * 4 + 1] = rgba[(x + y * w) * srccomps + 1] >> 2;
-							out[(x + y * w) * 4 + 2] = rgba[(x + y * w) * srccomps + 2] >> 3;
+							out[(x + y * w) * 4 + 0] = rgba[y * stride + x * srccomps + ri] >> 3;
+							out[(x + y * w) * 4 + 1] = rgba[y * stride + x * srccomps + 1] >> 2;
+							out[(x + y * w) * 4 + 2] = rgba[y * stride + x * srccomps + bi] >> 3;
 						}
 					if(srccomps == 4)
 					{
@@ -1281,19 +2637,19 @@ namespace
 						{
 							for(y = 0; y < h; ++y)
 								for(x = 0; x < w; ++x)
-									out[(x + y * w) * 4 + 3] = rgba[(x + y * w) * srccomps + 3] >> 7;
+									out[(x + y * w) * 4 + 3] = rgba[y * stride + x * srccomps + 3] >> 7;
 						}
 						else if(alphabits == 8)
 						{
 							for(y = 0; y < h; ++y)
 								for(x = 0; x < w; ++x)
-									out[(x + y * w) * 4 + 3] = rgba[(x + y * w) * srccomps + 3]; // no conversion
+									out[(x + y * w) * 4 + 3] = rgba[y * stride + x * srccomps + 3]; // no conversion
 						}
 						else
 						{
 							for(y = 0; y < h; ++y)
 								for(x = 0; x < w; ++x)
-									out[(x + y * w) * 4 + 3] = rgba[(x + y * w) * srccomps + 3] >> (8 - alphabits);
+									out[(x + y * w) * 4 + 3] = rgba[y * stride + x * srccomps + 3] >> (8 - alphabits);
 						}
 					}
 					else
@@ -1314,9 +2670,9 @@ namespace
 					for(y = 0; y < h; ++y)
 						for(x = 0; x < w; ++x)
 						{
-							out[(x + y * w) * 4 + 0] = diffuse(&diffuse_r, rgba[(x + y * w) * srccomps + 0], 3);
-							out[(x + y * w) * 4 + 1] = diffuse(&diffuse_g, rgba[(x + y * w) * srccomps + 1], 2);
-							out[(x + y * w) * 4 + 2] = diffuse(&diffuse_b, rgba[(x + y * w) * srccomps + 2], 3);
+							out[(x + y * w) * 4 + 0] = diffuse(&diffuse_r, rgba[y * stride + x * srccomps + ri], 3);
+							out[(x + y * w) * 4 + 1] = diffuse(&diffuse_g, rgba[y * stride + x * srccomps + 1], 2);
+							out[(x + y * w) * 4 + 2] = diffuse(&diffuse_b, rgba[y * stride + x * srccomps + bi], 3);
 						}
 					if(srccomps == 4)
 					{
@@ -1324,19 +2680,19 @@ namespace
 						{
 							for(y = 0; y < h; ++y)
 								for(x = 0; x < w; ++x)
-									out[(x + y * w) * 4 + 3] = diffuse1(&diffuse_a, rgba[(x + y * w) * srccomps + 3]);
+									out[(x + y * w) * 4 + 3] = diffuse1(&diffuse_a, rgba[y * stride + x * srccomps + 3]);
 						}
 						else if(alphabits == 8)
 						{
 							for(y = 0; y < h; ++y)
 								for(x = 0; x < w; ++x)
-									out[(x + y * w) * 4 + 3] = rgba[(x + y * w) * srccomps + 3]; // no conversion
+									out[(x + y * w) * 4 + 3] = rgba[y * stride + x * srccomps + 3]; // no conversion
 						}
 						else
 						{
 							for(y = 0; y < h; ++y)
 								for(x = 0; x < w; ++x)
-									out[(x + y * w) * 4 + 3] = diffuse(&diffuse_a, rgba[(x + y * w) * srccomps + 3], 8 - alphabits);
+									out[(x + y * w) * 4 + 3] = diffuse(&diffuse_a, rgba[y * stride + x * srccomps + 3], 8 - alphabits);
 						}
 					}
 					else
@@ -1366,9 +2722,9 @@ namespace
 						downrow_b = downrow_g + pw;
 						for(x = 0; x < w; ++x)
 						{
-							out[(x + y * w) * 4 + 0] = floyd(&thisrow_r[x], &downrow_r[x], rgba[(x + y * w) * srccomps + 0], 3);
-							out[(x + y * w) * 4 + 1] = floyd(&thisrow_g[x], &downrow_g[x], rgba[(x + y * w) * srccomps + 1], 2);
-							out[(x + y * w) * 4 + 2] = floyd(&thisrow_b[x], &downrow_b[x], rgba[(x + y * w) * srccomps + 2], 3);
+							out[(x + y * w) * 4 + 0] = floyd(&thisrow_r[x], &downrow_r[x], rgba[y * stride + x * srccomps + ri], 3);
+							out[(x + y * w) * 4 + 1] = floyd(&thisrow_g[x], &downrow_g[x], rgba[y * stride + x * srccomps + 1], 2);
+							out[(x + y * w) * 4 + 2] = floyd(&thisrow_b[x], &downrow_b[x], rgba[y * stride + x * srccomps + bi], 3);
 						}
 					}
 					if(srccomps == 4)
@@ -1381,14 +2737,14 @@ namespace
 								downrow_a = downrow + !(y&1) * pw;
 								memset(downrow_a, 0, sizeof(*downrow_a) * pw);
 								for(x = 0; x < w; ++x)
-									out[(x + y * w) * 4 + 3] = floyd1(&thisrow_a[x], &downrow_a[x], rgba[(x + y * w) * srccomps + 3]);
+									out[(x + y * w) * 4 + 3] = floyd1(&thisrow_a[x], &downrow_a[x], rgba[y * stride + x * srccomps + 3]);
 							}
 						}
 						else if(alphabits == 8)
 						{
 							for(y = 0; y < h; ++y)
 								for(x = 0; x < w; ++x)
-									out[(x + y * w) * 4 + 3] = rgba[(x + y * w) * srccomps + 3]; // no conversion
+									out[(x + y * w) * 4 + 3] = rgba[y * stride + x * srccomps + 3]; // no conversion
 						}
 						else
 						{
@@ -1398,7 +2754,7 @@ namespace
 								downrow_a = downrow + !(y&1) * pw;
 								memset(downrow_a, 0, sizeof(*downrow_a) * pw);
 								for(x = 0; x < w; ++x)
-									out[(x + y * w) * 4 + 3] = floyd(&thisrow_a[x], &downrow_a[x], rgba[(x + y * w) * srccomps + 3], 8 - alphabits);
+									out[(x + y * w) * 4 + 3] = floyd(&thisrow_a[x], &downrow_a[x], rgba[y * stride + x * srccomps + 3], 8 - alphabits);
 							}
 						}
 					}
@@ -1413,53 +2769,59 @@ namespace
 		}
 	}
 
-	template<int srccomps, int alphabits>
-	inline void rgb565_image(unsigned char *out, const unsigned char *rgba, int w, int h, DitherMode dither)
+	template<int srccomps, bool bgr, int alphabits>
+	inline void rgb565_image(unsigned char *out, const unsigned char *rgba, int w, int h, int stride, DitherMode dither)
 	{
 		switch(dither)
 		{
 			case DITHER_NONE:
-				rgb565_image<srccomps, alphabits, DITHER_NONE>(out, rgba, w, h);
+				rgb565_image<srccomps, bgr, alphabits, DITHER_NONE>(out, rgba, w, h, stride);
 				break;
 			default:
 			case DITHER_SIMPLE:
-				rgb565_image<srccomps, alphabits, DITHER_SIMPLE>(out, rgba, w, h);
+				rgb565_image<srccomps, bgr, alphabits, DITHER_SIMPLE>(out, rgba, w, h, stride);
 				break;
 			case DITHER_FLOYDSTEINBERG:
-				rgb565_image<srccomps, alphabits, DITHER_FLOYDSTEINBERG>(out, rgba, w, h);
+				rgb565_image<srccomps, bgr, alphabits, DITHER_FLOYDSTEINBERG>(out, rgba, w, h, stride);
 				break;
 		}
 	}
 
-	template<int srccomps>
-	inline void rgb565_image(unsigned char *out, const unsigned char *rgba, int w, int h, int alphabits, DitherMode dither)
+	template<int srccomps, bool bgr>
+	inline void rgb565_image(unsigned char *out, const unsigned char *rgba, int w, int h, int stride, int alphabits, DitherMode dither)
 	{
 		switch(alphabits)
 		{
 			case 1:
-				rgb565_image<srccomps, 1>(out, rgba, w, h, dither);
+				rgb565_image<srccomps, bgr, 1>(out, rgba, w, h, stride, dither);
 				break;
 			case 4:
-				rgb565_image<srccomps, 4>(out, rgba, w, h, dither);
+				rgb565_image<srccomps, bgr, 4>(out, rgba, w, h, stride, dither);
 				break;
 			default:
 			case 8:
-				rgb565_image<srccomps, 8>(out, rgba, w, h, dither);
+				rgb565_image<srccomps, bgr, 8>(out, rgba, w, h, stride, dither);
 				break;
 		}
 	}
 };
 
-void rgb565_image(unsigned char *out, const unsigned char *rgba, int w, int h, int srccomps, int alphabits, DitherMode dither)
+void rgb565_image(unsigned char *out, const unsigned char *rgba, int w, int h, int stride, int srccomps, int bgr, int alphabits, DitherMode dither)
 {
 	switch(srccomps)
 	{
 		case 3:
-			rgb565_image<3>(out, rgba, w, h, alphabits, dither);
+			if(bgr)
+				rgb565_image<3, true>(out, rgba, w, h, stride, alphabits, dither);
+			else
+				rgb565_image<3, false>(out, rgba, w, h, stride, alphabits, dither);
 			break;
 		case 4:
 		default:
-			rgb565_image<4>(out, rgba, w, h, alphabits, dither);
+			if(bgr)
+				rgb565_image<4, true>(out, rgba, w, h, stride, alphabits, dither);
+			else
+				rgb565_image<4, false>(out, rgba, w, h, stride, alphabits, dither);
 			break;
 	}
 }
@@ -24,6 +24,8 @@
 
 // note: this is a C header file!
 
+#include <stddef.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -35,7 +37,8 @@ enum DitherMode
 	DITHER_FLOYDSTEINBERG
 };
 
-void rgb565_image(unsigned char *out, const unsigned char *rgba, int w, int h, int srccomps, int alphabits, DitherMode dither);
+// stride: source row length in bytes; bgr: if nonzero, the source has blue first (BGR/BGRA)
+void rgb565_image(unsigned char *out, const unsigned char *rgba, int w, int h, int stride, int srccomps, int bgr, int alphabits, DitherMode dither);
 
 enum DxtMode
 {
@@ -62,8 +65,29 @@ typedef enum
 	NORMALMAP
 } ColorDistMode;
 
-typedef void (*s2tc_encode_block_func_t) (unsigned char *out, const unsigned char *rgba, int iw, int w, int h, int nrandom);
-s2tc_encode_block_func_t s2tc_encode_block_func(DxtMode dxt, ColorDistMode cd, int nrandom, RefinementMode refine);
+// seeds: nseeds blocks already encoded in the same format whose endpoints are extra candidate colors
+// (used only with random colors, nrandom > 0)
+typedef void (*s2tc_encode_block_func_t) (unsigned char *out, const unsigned char *rgba, int iw, int w, int h, int nrandom, const unsigned char *const *seeds, int nseeds);
+// full: if nonzero, the returned function only handles complete 4x4 blocks and ignores w and h
+s2tc_encode_block_func_t s2tc_encode_block_func(DxtMode dxt, ColorDistMode cd, int nrandom, RefinementMode refine, int full);
+
+// encodes nblocks consecutive complete 4x4 blocks of one block row at once
+typedef void (*s2tc_encode_blocks_func_t) (unsigned char *out, const unsigned char *rgba, int iw, int nblocks);
+// cross-block SIMD engine for the fast settings; NULL if these settings are not supported by it
+s2tc_encode_blocks_func_t s2tc_encode_blocks_func(DxtMode dxt, ColorDistMode cd, int nrandom, RefinementMode refine);
+// realtime engine: inset bounding box endpoints and a single projection pass
+// works directly on the unconverted source pixels (srccomps 3 or 4, RGB or BGR order), not on rgb565_image output
+typedef void (*s2tc_encode_blocks_realtime_func_t) (unsigned char *out, const unsigned char *src, int stride, int nblocks);
+s2tc_encode_blocks_realtime_func_t s2tc_encode_blocks_realtime_func(DxtMode dxt, int srccomps, int bgr);
+
+// luminance (srccomps 1) or luminance-alpha (srccomps 2) input, read in place; one block of w*h pixels
+typedef void (*s2tc_encode_gray_block_func_t) (unsigned char *out, const unsigned char *src, int stride, int w, int h);
+s2tc_encode_gray_block_func_t s2tc_encode_gray_block_func(DxtMode dxt, int srccomps);
+
+// S3TC blocks to S2TC, nblocks at in to out (which may be in): decodes the palette of each block and
+// picks the indices by the color distance, starting from its endpoints
+typedef void (*s2tc_transcode_blocks_func_t) (unsigned char *out, const unsigned char *in, size_t nblocks);
+s2tc_transcode_blocks_func_t s2tc_transcode_blocks_func(DxtMode dxt, ColorDistMode cd, RefinementMode refine);
 
 #ifdef __cplusplus
 }
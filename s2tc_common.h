@@ -90,6 +90,14 @@ template<class T, int count, int width> class bitarray
 	{
 		bits = 0;
 	}
+	inline T getbits() const
+	{
+		return bits;
+	}
+	inline void setbits(T v)
+	{
+		bits = v;
+	}
 	inline unsigned char getbyte(size_t p) const
 	{
 		return (bits >> (p * 8)) & 0xFF;
@@ -36,6 +36,23 @@ typedef void (tx_compress_dxtn_t)(GLint srccomps, GLint width, GLint height,
 		      const GLubyte *srcPixData, GLenum destformat,
 		      GLubyte *dest, GLint dstRowStride);
 tx_compress_dxtn_t *tx_compress_dxtn = NULL;
+#include "s2tc.h"
+typedef s2tc_context_t *(s2tc_context_create_t)(const s2tc_config_t *config);
+typedef int (s2tc_compress_image_t)(s2tc_context_t *ctx, int width, int height,
+			const unsigned char *src, int srcRowStride, s2tc_layout_t layout,
+			s2tc_format_t format, unsigned char *dest, int dstRowStride);
+typedef int (s2tc_compress_mip_t)(s2tc_context_t *ctx, int width, int height,
+		      const unsigned char *src, int srcRowStride, s2tc_layout_t layout,
+		      s2tc_format_t format, unsigned char *dest, int dstRowStride,
+		      const unsigned char *parent, int parentWidth, int parentHeight, int parentRowStride);
+typedef int (s2tc_compress_batch_t)(s2tc_context_t *ctx, const s2tc_image_t *images, int count);
+typedef void (s2tc_config_func_t)(s2tc_config_t *config);
+s2tc_context_create_t *s2tc_context_create_ptr = NULL;
+s2tc_compress_image_t *s2tc_compress_image_ptr = NULL;
+s2tc_compress_mip_t *s2tc_compress_mip_ptr = NULL;
+s2tc_compress_batch_t *s2tc_compress_batch_ptr = NULL;
+s2tc_config_func_t *s2tc_config_init_ptr = NULL;
+s2tc_config_func_t *s2tc_config_from_env_ptr = NULL;
 bool load_libraries(const char *n)
 {
 	void *l = dlopen(n, RTLD_NOW);
@@ -51,10 +68,28 @@ bool load_libraries(const char *n)
 		dlclose(l);
 		return false;
 	}
+	/* optional, other libtxc_dxtn implementations lack these */
+	s2tc_context_create_ptr = (s2tc_context_create_t *) dlsym(l, "s2tc_context_create");
+	s2tc_compress_image_ptr = (s2tc_compress_image_t *) dlsym(l, "s2tc_compress_image");
+	s2tc_compress_mip_ptr = (s2tc_compress_mip_t *) dlsym(l, "s2tc_compress_mip");
+	s2tc_compress_batch_ptr = (s2tc_compress_batch_t *) dlsym(l, "s2tc_compress_batch");
+	s2tc_config_init_ptr = (s2tc_config_func_t *) dlsym(l, "s2tc_config_init");
+	s2tc_config_from_env_ptr = (s2tc_config_func_t *) dlsym(l, "s2tc_config_from_env");
+	if(!s2tc_context_create_ptr || !s2tc_compress_image_ptr)
+		s2tc_context_create_ptr = NULL;
+	if(!s2tc_config_init_ptr || !s2tc_config_from_env_ptr)
+		s2tc_config_init_ptr = NULL;
 	return true;
 }
 #else
 #include "txc_dxtn.h"
+#include "s2tc.h"
+#define s2tc_context_create_ptr s2tc_context_create
+#define s2tc_compress_image_ptr s2tc_compress_image
+#define s2tc_compress_mip_ptr s2tc_compress_mip
+#define s2tc_compress_batch_ptr s2tc_compress_batch
+#define s2tc_config_init_ptr s2tc_config_init
+#define s2tc_config_from_env_ptr s2tc_config_from_env
 #endif
 
 /* START stuff that originates from image.c in DarkPlaces */
@@ -68,6 +103,7 @@ bool load_libraries(const char *n)
 */
 
 int image_width, image_height;
+bool image_grayscale;
 
 typedef struct _TargaHeader
 {
@@ -112,6 +148,7 @@ unsigned char *LoadTGA_BGRA (const unsigned char *f, int filesize)
 	targa_header.height = image_height = f[14] + f[15] * 256;
 	targa_header.pixel_size = f[16];
 	targa_header.attributes = f[17];
+	image_grayscale = (targa_header.image_type & ~8) == 3;
 
 	if (image_width > 32768 || image_height > 32768 || image_width <= 0 || image_height <= 0)
 	{
@@ -555,6 +592,7 @@ int usage(const char *me)
 			"    [-i infile.tga]\n"
 			"    [-o outfile.dds]\n"
 			"    [-t {DXT1|DXT3|DXT5}]\n"
+			"    [-j threads]\n"
 #ifdef ENABLE_RUNTIME_LINKING
 			"    [-l path_to_libtxc_dxtn.so]\n"
 #endif
@@ -563,22 +601,45 @@ int usage(const char *me)
 	return 1;
 }
 
+/* levels with at most this many pixels are compressed together by
+ * s2tc_compress_batch, one per thread; larger ones one after another,
+ * each split over all threads */
+#define BATCH_PIXELS (128 * 128)
+
+typedef struct
+{
+	int width, height;
+	unsigned char *pic; /* BGRA, or RGBA for tx_compress_dxtn */
+	unsigned char *gray; /* L or LA for grayscale input, else NULL */
+	size_t offset, size; /* of its blocks in the output */
+}
+mip_level_t;
+
 int main(int argc, char **argv)
 {
 	const char *infile = NULL, *outfile = NULL;
 	FILE *outfh;
-	unsigned char *picdata, *pic;
-	int x, mipcount, piclen;
+	unsigned char *picdata, *pic, *mippics, *mipgray = NULL, *obuf;
+	int x, i, mipcount, piclen;
+	size_t mippixels, outsize;
+	mip_level_t levels[32];
 	const char *fourcc;
 	int blocksize;
 	GLenum dxt = GL_COMPRESSED_RGBA_S3TC_DXT1_EXT;
+	s2tc_format_t format;
+	s2tc_context_t *ctx = NULL;
+	s2tc_config_t config;
+	bool have_config = false;
+	bool alphapixels = false;
+	bool failed = false;
+	int threads = -1;
 
 #ifdef ENABLE_RUNTIME_LINKING
 	const char *library = "libtxc_dxtn.so";
 #endif
 
 	int opt;
-	while((opt = getopt(argc, argv, "i:o:t:"
+	while((opt = getopt(argc, argv, "i:o:t:j:"
 #ifdef ENABLE_RUNTIME_LINKING
 					"l:"
 #endif
@@ -602,6 +663,11 @@ int main(int argc, char **argv)
 				else
 					return usage(argv[0]);
 				break;
+			case 'j':
+				threads = atoi(optarg);
+				if(threads < 0)
+					return usage(argv[0]);
+				break;
 #ifdef ENABLE_RUNTIME_LINKING
 			case 'l':
 				library = optarg;
@@ -632,10 +698,31 @@ int main(int argc, char **argv)
 	}
 
 	pic = LoadTGA_BGRA(picdata, piclen);
-	for(x = 0; x < image_width*image_height; ++x) {
-		unsigned char h = pic[4*x];
-		pic[4*x] = pic[4*x+2];
-		pic[4*x+2] = h;
+#ifdef ENABLE_RUNTIME_LINKING
+	if(s2tc_context_create_ptr && s2tc_config_init_ptr)
+#endif
+	{
+		/* the environment, but one thread per CPU unless told otherwise */
+		s2tc_config_init_ptr(&config);
+		s2tc_config_from_env_ptr(&config);
+		if(threads >= 0)
+			config.threads = threads;
+		else if(!getenv("S2TC_THREADS"))
+			config.threads = 0;
+		have_config = true;
+	}
+#ifdef ENABLE_RUNTIME_LINKING
+	if(s2tc_context_create_ptr)
+#endif
+		ctx = s2tc_context_create_ptr(have_config ? &config : NULL);
+	if(!ctx)
+	{
+		/* tx_compress_dxtn only takes RGBA */
+		for(x = 0; x < image_width*image_height; ++x) {
+			unsigned char h = pic[4*x];
+			pic[4*x] = pic[4*x+2];
+			pic[4*x+2] = h;
+		}
 	}
 	mipcount = 0;
 	while(image_width >= (1 << mipcount) || image_height >= (1 << mipcount))
@@ -647,21 +734,23 @@ int main(int argc, char **argv)
 		case GL_COMPRESSED_RGBA_S3TC_DXT1_EXT:
 			blocksize = 8;
 			fourcc = "DXT1";
+			format = S2TC_FORMAT_DXT1;
 			break;
 		case GL_COMPRESSED_RGBA_S3TC_DXT3_EXT:
 			blocksize = 16;
 			fourcc = "DXT3";
+			format = S2TC_FORMAT_DXT3;
 			break;
 		default:
 		case GL_COMPRESSED_RGBA_S3TC_DXT5_EXT:
 			blocksize = 16;
 			fourcc = "DXT5";
+			format = S2TC_FORMAT_DXT5;
 			break;
 	}
 
 	{
 		uint32_t zero = LittleLong(0);
-		bool alphapixels = false;
 		int x, y;
 		uint32_t dds_picsize, dds_mipcount, dds_width, dds_height;
 
@@ -719,19 +808,131 @@ int main(int argc, char **argv)
 		fwrite(&zero, 4, 1, outfh);
 	}
 
-	for(;;)
+	/* all levels are made up front, so they can be compressed at the same
+	 * time, into one buffer that is written at once */
+	mippixels = 0;
+	outsize = 0;
+	for(i = 0; i < mipcount; ++i)
 	{
-		int blocks_w = (image_width + 3) / 4;
-		int blocks_h = (image_height + 3) / 4;
-		GLubyte *obuf = (GLubyte *) malloc(blocksize * blocks_w * blocks_h);
-		tx_compress_dxtn(4, image_width, image_height, pic, dxt, obuf, blocks_w * blocksize);
-		fwrite(obuf, blocksize * blocks_w * blocks_h, 1, outfh);
-		free(obuf);
-		if(image_width == 1 && image_height == 1)
-			break;
-		Image_MipReduce32(pic, pic, &image_width, &image_height, 1, 1);
+		if(i > 0)
+		{
+			levels[i].width = levels[i - 1].width > 1 ? levels[i - 1].width >> 1 : 1;
+			levels[i].height = levels[i - 1].height > 1 ? levels[i - 1].height >> 1 : 1;
+			mippixels += (size_t) levels[i].width * levels[i].height;
+		}
+		else
+		{
+			levels[i].width = image_width;
+			levels[i].height = image_height;
+		}
+		levels[i].gray = NULL;
+		levels[i].offset = outsize;
+		levels[i].size = (size_t) ((levels[i].width + 3) / 4) * ((levels[i].height + 3) / 4) * blocksize;
+		outsize += levels[i].size;
+	}
+	mippics = (unsigned char *) malloc(mippixels * 4 + 4);
+	obuf = (unsigned char *) malloc(outsize);
+	if(!mippics || !obuf)
+	{
+		printf("out of memory\n");
+		return 2;
+	}
+	levels[0].pic = pic;
+	for(i = 1; i < mipcount; ++i)
+	{
+		int w = levels[i - 1].width, h = levels[i - 1].height;
+		levels[i].pic = (i == 1) ? mippics : levels[i - 1].pic + (size_t) w * h * 4;
+		Image_MipReduce32(levels[i - 1].pic, levels[i].pic, &w, &h, 1, 1);
+	}
+
+	if(ctx && image_grayscale)
+	{
+		/* hand the library only the gray (and alpha) channel */
+		int comps = alphapixels ? 2 : 1;
+		unsigned char *g = mipgray = (unsigned char *) malloc((image_width * image_height + mippixels) * comps);
+		if(!mipgray)
+		{
+			printf("out of memory\n");
+			return 2;
+		}
+		for(i = 0; i < mipcount; ++i)
+		{
+			levels[i].gray = g;
+			for(x = 0; x < levels[i].width * levels[i].height; ++x)
+			{
+				*g++ = levels[i].pic[4*x];
+				if(alphapixels)
+					*g++ = levels[i].pic[4*x+3];
+			}
+		}
 	}
 
+	if(!ctx)
+	{
+		for(i = 0; i < mipcount; ++i)
+			tx_compress_dxtn(4, levels[i].width, levels[i].height, levels[i].pic, dxt, obuf + levels[i].offset, ((levels[i].width + 3) / 4) * blocksize);
+	}
+	else if(!image_grayscale && s2tc_compress_mip_ptr && (!have_config || config.random_colors > 0))
+	{
+		/* the previous level's colors are candidates for this one, so the levels depend on each other */
+		for(i = 0; i < mipcount; ++i)
+			if(s2tc_compress_mip_ptr(ctx, levels[i].width, levels[i].height, levels[i].pic, levels[i].width * 4, S2TC_LAYOUT_BGRA, format,
+					obuf + levels[i].offset, ((levels[i].width + 3) / 4) * blocksize,
+					i ? obuf + levels[i - 1].offset : NULL, i ? levels[i - 1].width : 0, i ? levels[i - 1].height : 0, i ? ((levels[i - 1].width + 3) / 4) * blocksize : 0))
+				failed = true;
+	}
+	else
+	{
+		s2tc_image_t images[32];
+		int nimages = 0;
+		for(i = 0; i < mipcount; ++i)
+		{
+			s2tc_image_t *img = &images[nimages];
+			img->width = levels[i].width;
+			img->height = levels[i].height;
+			if(levels[i].gray)
+			{
+				img->src = levels[i].gray;
+				img->srcRowStride = levels[i].width * (alphapixels ? 2 : 1);
+				img->layout = alphapixels ? S2TC_LAYOUT_LA : S2TC_LAYOUT_L;
+			}
+			else
+			{
+				img->src = levels[i].pic;
+				img->srcRowStride = levels[i].width * 4;
+				img->layout = S2TC_LAYOUT_BGRA;
+			}
+			img->format = format;
+			img->dest = obuf + levels[i].offset;
+			img->dstRowStride = ((levels[i].width + 3) / 4) * blocksize;
+#ifdef ENABLE_RUNTIME_LINKING
+			if(!s2tc_compress_batch_ptr || levels[i].width * levels[i].height > BATCH_PIXELS)
+#else
+			if(levels[i].width * levels[i].height > BATCH_PIXELS)
+#endif
+			{
+				if(s2tc_compress_image_ptr(ctx, img->width, img->height, img->src, img->srcRowStride, img->layout, img->format, img->dest, img->dstRowStride))
+					failed = true;
+			}
+			else
+				++nimages;
+		}
+		/* the small levels, spread over the threads */
+		if(nimages && s2tc_compress_batch_ptr(ctx, images, nimages))
+			failed = true;
+	}
+	if(failed)
+	{
+		/* never write blocks that were not compressed */
+		printf("compression failed\n");
+		return 2;
+	}
+	fwrite(obuf, outsize, 1, outfh);
+
+	free(obuf);
+	free(mipgray);
+	free(mippics);
+
 	if(outfile)
 		fclose(outfh);
 
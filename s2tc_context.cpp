@@ -0,0 +1,1054 @@
+/*
+ * Copyright (C) 2011  Rudolf Polzer   All Rights Reserved.
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * RUDOLF POLZER BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN
+ * AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#define S2TC_LICENSE_IDENTIFIER s2tc_context_license
+#include "s2tc_license.h"
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "s2tc.h"
+#include "s2tc_algorithm.h"
+#include "s2tc_common.h"
+#include "s2tc_threadpool.h"
+
+// scratch memory, grown as needed; busy while a batch worker uses it
+struct s2tc_scratch_t
+{
+	unsigned char *data;
+	size_t size;
+	int busy;
+};
+
+struct s2tc_context_s
+{
+	s2tc_config_t config;
+
+	// kernels, resolved once per format
+	s2tc_encode_block_func_t encode_block[3];
+	s2tc_encode_block_func_t encode_full_block[3];
+	s2tc_encode_blocks_func_t encode_blocks[3];
+	s2tc_encode_blocks_realtime_func_t encode_realtime[3][4];
+	s2tc_encode_gray_block_func_t encode_gray[3][2];
+	s2tc_transcode_blocks_func_t transcode_blocks[3];
+
+	// held while the scratch memory and the threads are in use
+	pthread_mutex_t lock;
+	s2tc_threadpool_t *pool;
+	s2tc_scratch_t scratch;
+	// s2tc_compress_batch: one per thread of the pool, kept across calls
+	s2tc_scratch_t *slices;
+	int nslices;
+
+	// temporal warm start: the blocks of the last image and hashes of their
+	// input; prevwidth 0 means none is kept
+	unsigned char *prev;
+	uint64_t *hashes;
+	size_t prevsize;
+	int prevwidth, prevheight;
+	int prevformat;
+
+	// asynchronous jobs: the queue, highest priority first, and the thread
+	// running them, started by the first s2tc_compress_async
+	pthread_mutex_t queuelock;
+	pthread_cond_t queuecond;
+	s2tc_job_t *queue;
+	pthread_t dispatcher;
+	bool dispatcher_started;
+	bool quit;
+};
+
+enum
+{
+	S2TC_JOB_QUEUED,
+	S2TC_JOB_RUNNING,
+	S2TC_JOB_DONE,
+	S2TC_JOB_CANCELLED
+};
+
+struct s2tc_job_s
+{
+	s2tc_context_t *ctx;
+	s2tc_image_t image;
+	int priority;
+	s2tc_job_callback_t callback;
+	void *userdata;
+	int state; // S2TC_JOB_*, protected by the context's queuelock
+	int result;
+	bool released; // by its own callback; the dispatcher frees it afterwards
+	s2tc_job_t *next;
+};
+
+void s2tc_config_init(s2tc_config_t *config)
+{
+	config->mode = S2TC_MODE_NORMAL;
+	config->colordist = S2TC_COLORDIST_WAVG;
+	config->random_colors = -1;
+	config->refine = S2TC_REFINE_ALWAYS;
+	config->dither = S2TC_DITHER_SIMPLE;
+	config->neighbor_seeds = 0;
+	config->temporal = 0;
+	config->threads = 1;
+}
+
+void s2tc_config_from_env(s2tc_config_t *config)
+{
+	{
+		const char *v = getenv("S2TC_COMPRESSION_MODE");
+		if(v)
+		{
+			if(!strcasecmp(v, "NORMAL"))
+				config->mode = S2TC_MODE_NORMAL;
+			else if(!strcasecmp(v, "REALTIME"))
+				config->mode = S2TC_MODE_REALTIME;
+			else
+				fprintf(stderr, "Invalid compression mode: %s\n", v);
+		}
+	}
+	{
+		const char *v = getenv("S2TC_DITHER_MODE");
+		if(v)
+		{
+			if(!strcasecmp(v, "NONE"))
+				config->dither = S2TC_DITHER_NONE;
+			else if(!strcasecmp(v, "SIMPLE"))
+				config->dither = S2TC_DITHER_SIMPLE;
+			else if(!strcasecmp(v, "FLOYDSTEINBERG"))
+				config->dither = S2TC_DITHER_FLOYDSTEINBERG;
+			else
+				fprintf(stderr, "Invalid dither mode: %s\n", v);
+		}
+	}
+	{
+		const char *v = getenv("S2TC_COLORDIST_MODE");
+		if(v)
+		{
+			if(!strcasecmp(v, "RGB"))
+				config->colordist = S2TC_COLORDIST_RGB;
+			else if(!strcasecmp(v, "YUV"))
+				config->colordist = S2TC_COLORDIST_YUV;
+			else if(!strcasecmp(v, "SRGB"))
+				config->colordist = S2TC_COLORDIST_SRGB;
+			else if(!strcasecmp(v, "SRGB_MIXED"))
+				config->colordist = S2TC_COLORDIST_SRGB_MIXED;
+			else if(!strcasecmp(v, "AVG"))
+				config->colordist = S2TC_COLORDIST_AVG;
+			else if(!strcasecmp(v, "WAVG"))
+				config->colordist = S2TC_COLORDIST_WAVG;
+			else if(!strcasecmp(v, "W0AVG"))
+				config->colordist = S2TC_COLORDIST_W0AVG;
+			else if(!strcasecmp(v, "NORMALMAP"))
+				config->colordist = S2TC_COLORDIST_NORMALMAP;
+			else
+				fprintf(stderr, "Invalid color dist mode: %s\n", v);
+		}
+	}
+	{
+		const char *v = getenv("S2TC_RANDOM_COLORS");
+		if(v)
+			config->random_colors = atoi(v);
+	}
+	{
+		const char *v = getenv("S2TC_REFINE_COLORS");
+		if(v)
+		{
+			if(!strcasecmp(v, "NEVER"))
+				config->refine = S2TC_REFINE_NEVER;
+			else if(!strcasecmp(v, "ALWAYS"))
+				config->refine = S2TC_REFINE_ALWAYS;
+			else if(!strcasecmp(v, "LOOP"))
+				config->refine = S2TC_REFINE_LOOP;
+			else
+				fprintf(stderr, "Invalid refinement mode: %s\n", v);
+		}
+	}
+	{
+		const char *v = getenv("S2TC_NEIGHBOR_SEEDS");
+		if(v)
+			config->neighbor_seeds = atoi(v);
+	}
+	{
+		const char *v = getenv("S2TC_TEMPORAL");
+		if(v)
+			config->temporal = atoi(v);
+	}
+	{
+		const char *v = getenv("S2TC_THREADS");
+		if(v)
+			config->threads = atoi(v);
+	}
+}
+
+s2tc_context_t *s2tc_context_create(const s2tc_config_t *config)
+{
+	s2tc_context_t *ctx = (s2tc_context_t *) calloc(1, sizeof(*ctx));
+	int f;
+	if(!ctx)
+		return NULL;
+	if(config)
+		ctx->config = *config;
+	else
+	{
+		s2tc_config_init(&ctx->config);
+		s2tc_config_from_env(&ctx->config);
+	}
+
+	// the public enums list the same values in the same order as the internal ones
+	ColorDistMode cd = (ColorDistMode) ctx->config.colordist;
+	RefinementMode refine = (RefinementMode) ctx->config.refine;
+	int nrandom = ctx->config.random_colors;
+	for(f = 0; f < 3; ++f)
+	{
+		DxtMode dxt = (DxtMode) f;
+		ctx->encode_block[f] = s2tc_encode_block_func(dxt, cd, nrandom, refine, 0);
+		ctx->encode_full_block[f] = s2tc_encode_block_func(dxt, cd, nrandom, refine, 1);
+		ctx->encode_blocks[f] = s2tc_encode_blocks_func(dxt, cd, nrandom, refine);
+		ctx->encode_realtime[f][S2TC_LAYOUT_RGBA] = s2tc_encode_blocks_realtime_func(dxt, 4, 0);
+		ctx->encode_realtime[f][S2TC_LAYOUT_BGRA] = s2tc_encode_blocks_realtime_func(dxt, 4, 1);
+		ctx->encode_realtime[f][S2TC_LAYOUT_RGB] = s2tc_encode_blocks_realtime_func(dxt, 3, 0);
+		ctx->encode_realtime[f][S2TC_LAYOUT_BGR] = s2tc_encode_blocks_realtime_func(dxt, 3, 1);
+		ctx->encode_gray[f][0] = s2tc_encode_gray_block_func(dxt, 1);
+		ctx->encode_gray[f][1] = s2tc_encode_gray_block_func(dxt, 2);
+		ctx->transcode_blocks[f] = s2tc_transcode_blocks_func(dxt, cd, refine);
+	}
+
+	pthread_mutex_init(&ctx->lock, NULL);
+	pthread_mutex_init(&ctx->queuelock, NULL);
+	pthread_cond_init(&ctx->queuecond, NULL);
+	if(ctx->config.threads != 1)
+		ctx->pool = s2tc_threadpool_create(ctx->config.threads);
+	return ctx;
+}
+
+void s2tc_context_destroy(s2tc_context_t *ctx)
+{
+	if(!ctx)
+		return;
+	if(ctx->dispatcher_started)
+	{
+		pthread_mutex_lock(&ctx->queuelock);
+		ctx->quit = true;
+		pthread_cond_broadcast(&ctx->queuecond);
+		pthread_mutex_unlock(&ctx->queuelock);
+		pthread_join(ctx->dispatcher, NULL);
+	}
+	pthread_cond_destroy(&ctx->queuecond);
+	pthread_mutex_destroy(&ctx->queuelock);
+	s2tc_threadpool_destroy(ctx->pool);
+	pthread_mutex_destroy(&ctx->lock);
+	free(ctx->scratch.data);
+	for(int i = 0; i < ctx->nslices; ++i)
+		free(ctx->slices[i].data);
+	free(ctx->slices);
+	free(ctx->prev);
+	free(ctx->hashes);
+	free(ctx);
+}
+
+namespace
+{
+	// one block row per job item
+	struct s2tc_rows_t
+	{
+		const s2tc_context_t *ctx;
+		int f;
+		s2tc_layout_t layout;
+		int srccomps;
+		int width, height;
+		const unsigned char *src;
+		int srcstride;
+		unsigned char *dest;
+		int blocksize;
+		int pitch;
+		// neighbor seeding: blocks done per row, NULL if rows run in order
+		int *progress;
+		// mip chains: the previous, larger level, or NULL
+		const unsigned char *parent;
+		int parentwidth, parentheight;
+		int parentpitch;
+		// temporal warm start: the last image's blocks (packed) and their input hashes, or NULL
+		const unsigned char *orig;
+		unsigned char *prev;
+		uint64_t *hashes;
+		bool prevvalid;
+	};
+
+	// with neighbor seeding, a block waits for the one above it
+	inline void s2tc_wait_row(const s2tc_rows_t *job, int row, int blocks)
+	{
+		if(!job->progress || row < 0)
+			return;
+		while(__sync_fetch_and_add(&job->progress[row], 0) < blocks)
+			sched_yield();
+	}
+
+	inline uint64_t s2tc_block_hash(const unsigned char *in, int stride, int comps, int w, int h)
+	{
+		uint64_t hash = 14695981039346656037ull;
+		for(int y = 0; y < h; ++y)
+			for(int x = 0; x < w; ++x)
+			{
+				uint32_t v = 0;
+				memcpy(&v, &in[y * stride + x * comps], comps);
+				hash = (hash ^ v) * 1099511628211ull;
+				hash ^= hash >> 29;
+			}
+		return hash;
+	}
+
+	// temporal warm start: records the hash of block b of the row, and returns
+	// true if the last image had the same input there
+	// the source pixels are hashed, not the dithered ones, as error diffusion
+	// would let any change reach every block after it
+	inline bool s2tc_block_unchanged(const s2tc_rows_t *job, int row, int b, int w, int h)
+	{
+		uint64_t hash = s2tc_block_hash(job->orig + row * 4 * job->srcstride + b * 4 * job->srccomps, job->srcstride, job->srccomps, w, h);
+		uint64_t &old = job->hashes[row * ((job->width + 3) >> 2) + b];
+		bool same = job->prevvalid && old == hash;
+		old = hash;
+		return same;
+	}
+
+	inline unsigned char *s2tc_prev_block(const s2tc_rows_t *job, int row, int b)
+	{
+		return job->prev + (row * ((job->width + 3) >> 2) + b) * job->blocksize;
+	}
+
+	// the blocks of the parent level covering block (bx, by), at most 4
+	inline int s2tc_parent_seeds(const s2tc_rows_t *job, int bx, int by, const unsigned char **seeds)
+	{
+		int pbw = (job->parentwidth + 3) / 4;
+		int pbh = (job->parentheight + 3) / 4;
+		int fx = (job->parentwidth > job->width) ? 2 : 1;
+		int fy = (job->parentheight > job->height) ? 2 : 1;
+		int n = 0;
+		for(int y = by * fy; y < min(by * fy + fy, pbh); ++y)
+			for(int x = bx * fx; x < min(bx * fx + fx, pbw); ++x)
+				seeds[n++] = job->parent + y * job->parentpitch + x * job->blocksize;
+		return n;
+	}
+
+	void s2tc_encode_row(void *arg, int row)
+	{
+		const s2tc_rows_t *job = (const s2tc_rows_t *) arg;
+		const s2tc_context_t *ctx = job->ctx;
+		s2tc_encode_block_func_t encode_block = ctx->encode_block[job->f];
+		s2tc_encode_block_func_t encode_full_block = ctx->encode_full_block[job->f];
+		s2tc_encode_blocks_func_t encode_blocks = ctx->encode_blocks[job->f];
+		int nrandom = ctx->config.random_colors;
+		bool seeding = ctx->config.neighbor_seeds && nrandom > 0;
+		int width = job->width;
+		int j = row * 4;
+		int i = 0;
+		int numxpixels, numypixels = min(job->height - j, 4);
+		const unsigned char *srcaddr = job->src + j * width * 4;
+		unsigned char *blkaddr = job->dest + row * job->pitch;
+		const unsigned char *seeds[7];
+		int nseeds;
+		if(encode_blocks && numypixels == 4 && !job->prev)
+		{
+			// all complete blocks of the row at once
+			encode_blocks(blkaddr, srcaddr, width, width >> 2);
+			i = width & ~3;
+			srcaddr += 4 * i;
+			blkaddr += job->blocksize * (width >> 2);
+		}
+		else if(encode_blocks && numypixels == 4)
+		{
+			// runs of changed blocks at once, unchanged ones are copied
+			int nblocks = width >> 2;
+			int b = 0, e;
+			while(b < nblocks)
+			{
+				for(e = b; e < nblocks; ++e)
+					if(s2tc_block_unchanged(job, row, e, 4, 4))
+						break;
+				encode_blocks(blkaddr, srcaddr, width, e - b);
+				memcpy(s2tc_prev_block(job, row, b), blkaddr, (e - b) * job->blocksize);
+				if(e < nblocks)
+				{
+					memcpy(blkaddr + (e - b) * job->blocksize, s2tc_prev_block(job, row, e), job->blocksize);
+					++e;
+				}
+				srcaddr += 16 * (e - b);
+				blkaddr += job->blocksize * (e - b);
+				b = e;
+			}
+			i = width & ~3;
+		}
+		for(; i < width; i += 4)
+		{
+			numxpixels = min(width - i, 4);
+			if(job->prev && s2tc_block_unchanged(job, row, i >> 2, numxpixels, numypixels))
+			{
+				memcpy(blkaddr, s2tc_prev_block(job, row, i >> 2), job->blocksize);
+				if(job->progress)
+					__sync_fetch_and_add(&job->progress[row], 1);
+				srcaddr += 4 * numxpixels;
+				blkaddr += job->blocksize;
+				continue;
+			}
+			nseeds = 0;
+			if(seeding)
+			{
+				if(i > 0)
+					seeds[nseeds++] = blkaddr - job->blocksize;
+				if(row > 0)
+				{
+					s2tc_wait_row(job, row - 1, (i >> 2) + 1);
+					seeds[nseeds++] = blkaddr - job->pitch;
+				}
+			}
+			if(job->parent && nrandom > 0)
+				nseeds += s2tc_parent_seeds(job, i >> 2, row, seeds + nseeds);
+			if(job->prevvalid && nrandom > 0)
+				seeds[nseeds++] = s2tc_prev_block(job, row, i >> 2);
+			if(numxpixels == 4 && numypixels == 4)
+				encode_full_block(blkaddr, srcaddr, width, 4, 4, nrandom, seeds, nseeds);
+			else
+				encode_block(blkaddr, srcaddr, width, numxpixels, numypixels, nrandom, seeds, nseeds);
+			if(job->prev)
+				memcpy(s2tc_prev_block(job, row, i >> 2), blkaddr, job->blocksize);
+			if(job->progress)
+				__sync_fetch_and_add(&job->progress[row], 1);
+			srcaddr += 4 * numxpixels;
+			blkaddr += job->blocksize;
+		}
+	}
+
+	void s2tc_encode_row_realtime(void *arg, int row)
+	{
+		const s2tc_rows_t *job = (const s2tc_rows_t *) arg;
+		int srccomps = job->srccomps;
+		s2tc_encode_blocks_realtime_func_t encode_blocks = job->ctx->encode_realtime[job->f][job->layout];
+		int width = job->width;
+		int j = row * 4;
+		int i = 0;
+		int numxpixels, numypixels = min(job->height - j, 4);
+		const unsigned char *rowaddr = job->src + j * job->srcstride;
+		unsigned char *blkaddr = job->dest + row * job->pitch;
+		unsigned char pad[16 * 4];
+		int x, y;
+		if(numypixels == 4)
+		{
+			encode_blocks(blkaddr, rowaddr, job->srcstride, width >> 2);
+			i = width & ~3;
+			blkaddr += job->blocksize * (width >> 2);
+		}
+		for(; i < width; i += 4)
+		{
+			// partial block: repeat the edge pixels
+			numxpixels = min(width - i, 4);
+			for(y = 0; y < 4; ++y)
+				for(x = 0; x < 4; ++x)
+					memcpy(&pad[(y * 4 + x) * srccomps], &rowaddr[min(y, numypixels - 1) * job->srcstride + (i + min(x, numxpixels - 1)) * srccomps], srccomps);
+			encode_blocks(blkaddr, pad, 4 * srccomps, 1);
+			blkaddr += job->blocksize;
+		}
+	}
+
+	void s2tc_encode_row_gray(void *arg, int row)
+	{
+		const s2tc_rows_t *job = (const s2tc_rows_t *) arg;
+		int srccomps = job->srccomps;
+		s2tc_encode_gray_block_func_t encode_block = job->ctx->encode_gray[job->f][srccomps - 1];
+		int width = job->width;
+		int j = row * 4;
+		int numypixels = min(job->height - j, 4);
+		const unsigned char *srcaddr = job->src + j * job->srcstride;
+		unsigned char *blkaddr = job->dest + row * job->pitch;
+		for(int i = 0; i < width; i += 4)
+		{
+			encode_block(blkaddr, srcaddr + i * srccomps, job->srcstride, min(width - i, 4), numypixels);
+			blkaddr += job->blocksize;
+		}
+	}
+
+	unsigned char *s2tc_scratch_get(s2tc_scratch_t *scratch, size_t size)
+	{
+		if(scratch->size < size)
+		{
+			unsigned char *p = (unsigned char *) realloc(scratch->data, size);
+			if(!p)
+				return NULL;
+			scratch->data = p;
+			scratch->size = size;
+		}
+		return scratch->data;
+	}
+
+	// images up to this size (mip tails, icons) are encoded in the calling
+	// thread, with scratch memory on the stack: waking the workers and a
+	// malloc would cost more than the encoding
+	const int s2tc_small_image = 64 * 64;
+
+	// temporal: whether the temporal warm start state may be used and updated
+	int s2tc_compress_region(s2tc_context_t *ctx, int width, int height,
+			const unsigned char *src, int srcRowStride, s2tc_layout_t layout,
+			s2tc_format_t format, unsigned char *dest, int dstRowStride,
+			const unsigned char *parent, int parentWidth, int parentHeight, int parentRowStride,
+			bool temporal, s2tc_scratch_t *scratch)
+	{
+		s2tc_rows_t job;
+		int alphabits;
+		int bgr;
+		switch(format)
+		{
+			case S2TC_FORMAT_DXT1:
+				alphabits = 1;
+				job.blocksize = 8;
+				break;
+			case S2TC_FORMAT_DXT3:
+				alphabits = 4;
+				job.blocksize = 16;
+				break;
+			case S2TC_FORMAT_DXT5:
+				alphabits = 8;
+				job.blocksize = 16;
+				break;
+			default:
+				return -1;
+		}
+		switch(layout)
+		{
+			case S2TC_LAYOUT_RGBA:
+				job.srccomps = 4;
+				bgr = 0;
+				break;
+			case S2TC_LAYOUT_BGRA:
+				job.srccomps = 4;
+				bgr = 1;
+				break;
+			case S2TC_LAYOUT_RGB:
+				job.srccomps = 3;
+				bgr = 0;
+				break;
+			case S2TC_LAYOUT_BGR:
+				job.srccomps = 3;
+				bgr = 1;
+				break;
+			case S2TC_LAYOUT_L:
+				job.srccomps = 1;
+				bgr = 0;
+				break;
+			case S2TC_LAYOUT_LA:
+				job.srccomps = 2;
+				bgr = 0;
+				break;
+			default:
+				return -1;
+		}
+		if(!ctx || width < 0 || height < 0 || srcRowStride < width * job.srccomps)
+			return -1;
+
+		job.ctx = ctx;
+		job.f = (int) format;
+		job.layout = layout;
+		job.width = width;
+		job.height = height;
+		job.srcstride = srcRowStride;
+		job.dest = dest;
+		// hmm we used to get called without dstRowStride...
+		job.pitch = ((width + 3) & ~3) * job.blocksize / 4;
+		if(dstRowStride >= width * job.blocksize / 4)
+			job.pitch = dstRowStride;
+		job.parent = parent;
+		job.parentwidth = parentWidth;
+		job.parentheight = parentHeight;
+		job.parentpitch = ((parentWidth + 3) & ~3) * job.blocksize / 4;
+		if(parentRowStride >= parentWidth * job.blocksize / 4)
+			job.parentpitch = parentRowStride;
+		if(parent && (parentWidth < width || parentHeight < height || parentWidth > 2 * width + 1 || parentHeight > 2 * height + 1))
+			return -1;
+		int rows = (height + 3) / 4;
+
+		// if another thread is using the context, work on our own
+		bool owner = !pthread_mutex_trylock(&ctx->lock);
+		s2tc_threadpool_t *pool = owner ? ctx->pool : NULL;
+		if(width * height <= s2tc_small_image)
+			pool = NULL;
+
+		if(job.srccomps <= 2)
+		{
+			// gray input has its own encoder in all modes
+			job.src = src;
+			s2tc_threadpool_run(pool, s2tc_encode_row_gray, &job, rows);
+			if(owner)
+				pthread_mutex_unlock(&ctx->lock);
+			return 0;
+		}
+
+		if(ctx->config.mode == S2TC_MODE_REALTIME)
+		{
+			// straight from the source pixels, no conversion pass, so no dithering
+			job.src = src;
+			s2tc_threadpool_run(pool, s2tc_encode_row_realtime, &job, rows);
+			if(owner)
+				pthread_mutex_unlock(&ctx->lock);
+			return 0;
+		}
+
+		unsigned char small[s2tc_small_image * 4];
+		size_t size = (size_t) width * height * 4;
+		unsigned char *rgba;
+		if(size <= sizeof(small))
+			rgba = small;
+		else if(owner || scratch)
+		{
+			rgba = s2tc_scratch_get(owner ? &ctx->scratch : scratch, size);
+			if(!rgba)
+			{
+				if(owner)
+					pthread_mutex_unlock(&ctx->lock);
+				return -1;
+			}
+		}
+		else
+		{
+			rgba = (unsigned char *) malloc(size);
+			if(!rgba)
+				return -1;
+		}
+
+		// temporal warm start: only the thread owning the context keeps the blocks
+		job.orig = src;
+		job.prev = NULL;
+		job.hashes = NULL;
+		job.prevvalid = false;
+		if(owner && temporal && ctx->config.temporal)
+		{
+			size_t nblocks = (size_t) ((width + 3) / 4) * rows;
+			if(ctx->prevwidth != width || ctx->prevheight != height || ctx->prevformat != (int) format)
+				ctx->prevwidth = 0;
+			if(ctx->prevsize < nblocks)
+			{
+				// room for 16 byte blocks, so the format may change
+				unsigned char *p = (unsigned char *) realloc(ctx->prev, nblocks * 16);
+				if(p)
+					ctx->prev = p;
+				uint64_t *hp = (uint64_t *) realloc(ctx->hashes, nblocks * sizeof(*hp));
+				if(hp)
+					ctx->hashes = hp;
+				if(!p || !hp)
+				{
+					pthread_mutex_unlock(&ctx->lock);
+					return -1;
+				}
+				ctx->prevsize = nblocks;
+				ctx->prevwidth = 0;
+			}
+			job.prev = ctx->prev;
+			job.hashes = ctx->hashes;
+			job.prevvalid = ctx->prevwidth != 0;
+		}
+
+		// rows are claimed in order, so the row above is always in progress or done
+		job.progress = NULL;
+		if(ctx->config.neighbor_seeds && ctx->config.random_colors > 0 && s2tc_threadpool_size(pool) > 1)
+		{
+			job.progress = (int *) calloc(rows, sizeof(*job.progress));
+			if(!job.progress)
+			{
+				if(owner)
+					pthread_mutex_unlock(&ctx->lock);
+				else if(rgba != small && !scratch)
+					free(rgba);
+				return -1;
+			}
+		}
+
+		rgb565_image(rgba, src, width, height, srcRowStride, job.srccomps, bgr, alphabits, (DitherMode) ctx->config.dither);
+		job.src = rgba;
+		s2tc_threadpool_run(pool, s2tc_encode_row, &job, rows);
+
+		if(job.prev)
+		{
+			ctx->prevwidth = width;
+			ctx->prevheight = height;
+			ctx->prevformat = (int) format;
+		}
+		free(job.progress);
+		if(owner)
+			pthread_mutex_unlock(&ctx->lock);
+		else if(rgba != small && !scratch)
+			free(rgba);
+		return 0;
+	}
+
+	struct s2tc_batch_t
+	{
+		s2tc_context_t *ctx;
+		const s2tc_image_t *images;
+		s2tc_scratch_t *slices;
+		int nslices;
+		int failed;
+	};
+
+	// one image per job item; the batch holds the context, so each image is
+	// encoded in the worker's thread, in a scratch slice it claims for that
+	// image: no more images run at once than there are slices
+	void s2tc_compress_batch_item(void *arg, int i)
+	{
+		s2tc_batch_t *batch = (s2tc_batch_t *) arg;
+		const s2tc_image_t *img = &batch->images[i];
+		int k = 0;
+		while(__sync_lock_test_and_set(&batch->slices[k].busy, 1))
+			k = (k + 1) % batch->nslices;
+		if(s2tc_compress_region(batch->ctx, img->width, img->height, img->src, img->srcRowStride, img->layout,
+					img->format, img->dest, img->dstRowStride, NULL, 0, 0, 0, false, &batch->slices[k]))
+			__sync_fetch_and_or(&batch->failed, 1);
+		__sync_lock_release(&batch->slices[k].busy);
+	}
+
+	// blocks per s2tc_requantize_from_s3tc job item
+	const size_t s2tc_requantize_blocks = 4096;
+
+	struct s2tc_requantize_t
+	{
+		s2tc_transcode_blocks_func_t transcode;
+		const unsigned char *src;
+		unsigned char *dst;
+		size_t nblocks;
+		size_t blocksize;
+	};
+
+	void s2tc_requantize_item(void *arg, int i)
+	{
+		s2tc_requantize_t *job = (s2tc_requantize_t *) arg;
+		size_t first = i * s2tc_requantize_blocks;
+		size_t n = min(job->nblocks - first, s2tc_requantize_blocks);
+		job->transcode(job->dst + first * job->blocksize, job->src + first * job->blocksize, n);
+	}
+
+	// queue functions are called with the queuelock held
+	void s2tc_job_enqueue(s2tc_context_t *ctx, s2tc_job_t *job)
+	{
+		// behind all jobs of the same or a higher priority
+		s2tc_job_t **p = &ctx->queue;
+		while(*p && (*p)->priority >= job->priority)
+			p = &(*p)->next;
+		job->next = *p;
+		*p = job;
+	}
+
+	void s2tc_job_dequeue(s2tc_context_t *ctx, s2tc_job_t *job)
+	{
+		s2tc_job_t **p = &ctx->queue;
+		while(*p != job)
+			p = &(*p)->next;
+		*p = job->next;
+		job->next = NULL;
+	}
+
+	void *s2tc_dispatcher_thread(void *arg)
+	{
+		s2tc_context_t *ctx = (s2tc_context_t *) arg;
+		pthread_mutex_lock(&ctx->queuelock);
+		for(;;)
+		{
+			while(!ctx->quit && !ctx->queue)
+				pthread_cond_wait(&ctx->queuecond, &ctx->queuelock);
+			if(ctx->quit)
+			{
+				// nobody will run them any more
+				while(ctx->queue)
+				{
+					s2tc_job_t *job = ctx->queue;
+					s2tc_job_dequeue(ctx, job);
+					job->state = S2TC_JOB_CANCELLED;
+					job->result = -1;
+				}
+				pthread_cond_broadcast(&ctx->queuecond);
+				break;
+			}
+			s2tc_job_t *job = ctx->queue;
+			s2tc_job_dequeue(ctx, job);
+			job->state = S2TC_JOB_RUNNING;
+			pthread_mutex_unlock(&ctx->queuelock);
+
+			// rows still go to the thread pool, as for s2tc_compress_image
+			const s2tc_image_t *img = &job->image;
+			int result = s2tc_compress_image(ctx, img->width, img->height, img->src, img->srcRowStride, img->layout,
+					img->format, img->dest, img->dstRowStride);
+			// the job only counts as done once the callback returned
+			if(job->callback)
+				job->callback(job, result, job->userdata);
+
+			pthread_mutex_lock(&ctx->queuelock);
+			if(job->released)
+			{
+				free(job);
+				continue;
+			}
+			job->result = result;
+			job->state = S2TC_JOB_DONE;
+			pthread_cond_broadcast(&ctx->queuecond);
+		}
+		pthread_mutex_unlock(&ctx->queuelock);
+		return NULL;
+	}
+};
+
+int s2tc_compress(s2tc_context_t *ctx, int srccomps, int width, int height,
+		  const unsigned char *src, s2tc_format_t format,
+		  unsigned char *dest, int dstRowStride)
+{
+	s2tc_layout_t layout;
+	switch(srccomps)
+	{
+		case 1:
+			layout = S2TC_LAYOUT_L;
+			break;
+		case 2:
+			layout = S2TC_LAYOUT_LA;
+			break;
+		case 3:
+			layout = S2TC_LAYOUT_RGB;
+			break;
+		case 4:
+			layout = S2TC_LAYOUT_RGBA;
+			break;
+		default:
+			return -1;
+	}
+	return s2tc_compress_image(ctx, width, height, src, width * srccomps, layout, format, dest, dstRowStride);
+}
+
+int s2tc_compress_image(s2tc_context_t *ctx, int width, int height,
+			const unsigned char *src, int srcRowStride, s2tc_layout_t layout,
+			s2tc_format_t format, unsigned char *dest, int dstRowStride)
+{
+	return s2tc_compress_mip(ctx, width, height, src, srcRowStride, layout, format, dest, dstRowStride, NULL, 0, 0, 0);
+}
+
+int s2tc_compress_mip(s2tc_context_t *ctx, int width, int height,
+		      const unsigned char *src, int srcRowStride, s2tc_layout_t layout,
+		      s2tc_format_t format, unsigned char *dest, int dstRowStride,
+		      const unsigned char *parent, int parentWidth, int parentHeight, int parentRowStride)
+{
+	return s2tc_compress_region(ctx, width, height, src, srcRowStride, layout, format, dest, dstRowStride, parent, parentWidth, parentHeight, parentRowStride, true, NULL);
+}
+
+int s2tc_compress_rect(s2tc_context_t *ctx, int imageWidth, int imageHeight,
+		       const unsigned char *src, int srcRowStride, s2tc_layout_t layout,
+		       int x, int y, int width, int height,
+		       s2tc_format_t format, unsigned char *dest, int dstRowStride)
+{
+	int srccomps, blocksize;
+	switch(layout)
+	{
+		case S2TC_LAYOUT_RGBA:
+		case S2TC_LAYOUT_BGRA:
+			srccomps = 4;
+			break;
+		case S2TC_LAYOUT_RGB:
+		case S2TC_LAYOUT_BGR:
+			srccomps = 3;
+			break;
+		case S2TC_LAYOUT_LA:
+			srccomps = 2;
+			break;
+		case S2TC_LAYOUT_L:
+			srccomps = 1;
+			break;
+		default:
+			return -1;
+	}
+	blocksize = (format == S2TC_FORMAT_DXT1) ? 8 : 16;
+	if(x < 0 || y < 0 || width < 0 || height < 0 || x + width > imageWidth || y + height > imageHeight)
+		return -1;
+	if((x & 3) || (y & 3) || ((width & 3) && x + width != imageWidth) || ((height & 3) && y + height != imageHeight))
+		return -1;
+	if(srcRowStride < imageWidth * srccomps)
+		return -1;
+	if(dstRowStride < ((imageWidth + 3) / 4) * blocksize)
+		dstRowStride = ((imageWidth + 3) / 4) * blocksize;
+
+	// the rectangle is encoded like an image of its own
+	return s2tc_compress_region(ctx, width, height, src + y * srcRowStride + x * srccomps, srcRowStride, layout,
+			format, dest + (y / 4) * dstRowStride + (x / 4) * blocksize, dstRowStride, NULL, 0, 0, 0, false, NULL);
+}
+
+int s2tc_compress_batch(s2tc_context_t *ctx, const s2tc_image_t *images, int count)
+{
+	s2tc_batch_t batch;
+	if(!ctx || count < 0)
+		return -1;
+	batch.ctx = ctx;
+	batch.images = images;
+	batch.failed = 0;
+
+	// if another thread is using the context, compress them all in this one
+	bool owner = !pthread_mutex_trylock(&ctx->lock);
+	s2tc_scratch_t own = { NULL, 0, 0 };
+	batch.slices = &own;
+	batch.nslices = 1;
+	if(owner)
+	{
+		int n = s2tc_threadpool_size(ctx->pool);
+		if(ctx->nslices < n)
+		{
+			s2tc_scratch_t *p = (s2tc_scratch_t *) realloc(ctx->slices, n * sizeof(*p));
+			if(!p)
+			{
+				pthread_mutex_unlock(&ctx->lock);
+				return -1;
+			}
+			memset(p + ctx->nslices, 0, (n - ctx->nslices) * sizeof(*p));
+			ctx->slices = p;
+			ctx->nslices = n;
+		}
+		batch.slices = ctx->slices;
+		batch.nslices = ctx->nslices;
+	}
+	s2tc_threadpool_run(owner ? ctx->pool : NULL, s2tc_compress_batch_item, &batch, count);
+	if(owner)
+		pthread_mutex_unlock(&ctx->lock);
+	free(own.data);
+	return batch.failed ? -1 : 0;
+}
+
+int s2tc_requantize_from_s3tc(s2tc_context_t *ctx, const unsigned char *src, unsigned char *dst, size_t nblocks, s2tc_format_t format)
+{
+	s2tc_requantize_t job;
+	if(!ctx || !src || !dst || format < S2TC_FORMAT_DXT1 || format > S2TC_FORMAT_DXT5)
+		return -1;
+	job.transcode = ctx->transcode_blocks[format];
+	job.src = src;
+	job.dst = dst;
+	job.nblocks = nblocks;
+	job.blocksize = (format == S2TC_FORMAT_DXT1) ? 8 : 16;
+
+	// items never share a block, so in place conversion is safe
+	bool owner = !pthread_mutex_trylock(&ctx->lock);
+	s2tc_threadpool_run(owner ? ctx->pool : NULL, s2tc_requantize_item, &job, (nblocks + s2tc_requantize_blocks - 1) / s2tc_requantize_blocks);
+	if(owner)
+		pthread_mutex_unlock(&ctx->lock);
+	return 0;
+}
+
+s2tc_job_t *s2tc_compress_async(s2tc_context_t *ctx, const s2tc_image_t *image, int priority,
+				s2tc_job_callback_t callback, void *userdata)
+{
+	if(!ctx || !image)
+		return NULL;
+	s2tc_job_t *job = (s2tc_job_t *) calloc(1, sizeof(*job));
+	if(!job)
+		return NULL;
+	job->ctx = ctx;
+	job->image = *image;
+	job->priority = priority;
+	job->callback = callback;
+	job->userdata = userdata;
+	job->state = S2TC_JOB_QUEUED;
+	job->result = -1;
+
+	pthread_mutex_lock(&ctx->queuelock);
+	if(!ctx->dispatcher_started)
+	{
+		if(pthread_create(&ctx->dispatcher, NULL, s2tc_dispatcher_thread, ctx))
+		{
+			pthread_mutex_unlock(&ctx->queuelock);
+			free(job);
+			return NULL;
+		}
+		ctx->dispatcher_started = true;
+	}
+	s2tc_job_enqueue(ctx, job);
+	pthread_cond_broadcast(&ctx->queuecond);
+	pthread_mutex_unlock(&ctx->queuelock);
+	return job;
+}
+
+int s2tc_job_poll(s2tc_job_t *job)
+{
+	s2tc_context_t *ctx = job->ctx;
+	pthread_mutex_lock(&ctx->queuelock);
+	bool finished = job->state == S2TC_JOB_DONE || job->state == S2TC_JOB_CANCELLED;
+	pthread_mutex_unlock(&ctx->queuelock);
+	return finished;
+}
+
+int s2tc_job_wait(s2tc_job_t *job)
+{
+	s2tc_context_t *ctx = job->ctx;
+	pthread_mutex_lock(&ctx->queuelock);
+	while(job->state == S2TC_JOB_QUEUED || job->state == S2TC_JOB_RUNNING)
+		pthread_cond_wait(&ctx->queuecond, &ctx->queuelock);
+	int result = job->result;
+	pthread_mutex_unlock(&ctx->queuelock);
+	return result;
+}
+
+int s2tc_job_cancel(s2tc_job_t *job)
+{
+	s2tc_context_t *ctx = job->ctx;
+	int ret = -1;
+	pthread_mutex_lock(&ctx->queuelock);
+	if(job->state == S2TC_JOB_QUEUED)
+	{
+		s2tc_job_dequeue(ctx, job);
+		job->state = S2TC_JOB_CANCELLED;
+		pthread_cond_broadcast(&ctx->queuecond);
+		ret = 0;
+	}
+	pthread_mutex_unlock(&ctx->queuelock);
+	return ret;
+}
+
+int s2tc_job_set_priority(s2tc_job_t *job, int priority)
+{
+	s2tc_context_t *ctx = job->ctx;
+	int ret = -1;
+	pthread_mutex_lock(&ctx->queuelock);
+	if(job->state == S2TC_JOB_QUEUED)
+	{
+		s2tc_job_dequeue(ctx, job);
+		job->priority = priority;
+		s2tc_job_enqueue(ctx, job);
+		ret = 0;
+	}
+	pthread_mutex_unlock(&ctx->queuelock);
+	return ret;
+}
+
+void s2tc_job_release(s2tc_job_t *job)
+{
+	if(!job)
+		return;
+	s2tc_context_t *ctx = job->ctx;
+	pthread_mutex_lock(&ctx->queuelock);
+	if(job->state == S2TC_JOB_RUNNING && pthread_equal(pthread_self(), ctx->dispatcher))
+	{
+		// from its own callback: waiting would never end
+		job->released = true;
+		pthread_mutex_unlock(&ctx->queuelock);
+		return;
+	}
+	pthread_mutex_unlock(&ctx->queuelock);
+	s2tc_job_cancel(job);
+	s2tc_job_wait(job);
+	free(job);
+}
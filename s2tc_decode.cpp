@@ -0,0 +1,347 @@
+/*
+ * Copyright (C) 2011  Rudolf Polzer   All Rights Reserved.
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * RUDOLF POLZER BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN
+ * AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#define S2TC_LICENSE_IDENTIFIER s2tc_decode_license
+#include "s2tc_license.h"
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "s2tc.h"
+#include "s2tc_algorithm.h"
+#include "s2tc_common.h"
+
+#ifdef __GNUC__
+#define S2TC_ALWAYS_INLINE __attribute__((always_inline))
+#else
+#define S2TC_ALWAYS_INLINE
+#endif
+
+namespace
+{
+	// a 565 color as an output pixel: the bytes as stored in memory for the
+	// 8 bit formats, the native 16 bit value for the others
+	template<s2tc_pixel_format_t pf>
+	inline uint32_t s2tc_pixel(unsigned int c, unsigned char a)
+	{
+		if(pf == S2TC_PIXEL_RGB565)
+			return c;
+		if(pf == S2TC_PIXEL_RGBA5551)
+			return (c & 0xFFC0) | ((c & 0x1F) << 1) | (a >> 7);
+		unsigned char t[4];
+		int r = (pf == S2TC_PIXEL_BGRA8) ? 2 : 0;
+		t[r]     = ((c >> 11) & 0x1F); t[r]     = (t[r]     << 3) | (t[r]     >> 2);
+		t[1]     = ((c >>  5) & 0x3F); t[1]     = (t[1]     << 2) | (t[1]     >> 4);
+		t[2 - r] = ((c      ) & 0x1F); t[2 - r] = (t[2 - r] << 3) | (t[2 - r] >> 2);
+		t[3] = a;
+		uint32_t p;
+		memcpy(&p, t, 4);
+		return p;
+	}
+
+	// a block's endpoints and index bits, expanded once per block
+	struct s2tc_palette_t
+	{
+		uint32_t p0, p1;
+		uint32_t keep3;
+		uint32_t bits;
+		uint32_t a0, a1;
+		uint32_t special;
+		uint32_t alo, ahi;
+	};
+
+	template<DxtMode dxt, s2tc_pixel_format_t pf>
+	inline S2TC_ALWAYS_INLINE void s2tc_palette(const unsigned char *in, s2tc_palette_t *p)
+	{
+		const unsigned char *cin = (dxt == DXT1) ? in : in + 8;
+		unsigned int c0 = cin[0] + 256 * cin[1];
+		unsigned int c1 = cin[2] + 256 * cin[3];
+		p->p0 = s2tc_pixel<pf>(c0, 255);
+		p->p1 = s2tc_pixel<pf>(c1, 255);
+		// index 3 is transparent black in a DXT1 block with c1 >= c0,
+		// otherwise 2 and 3 are dithered between the endpoints
+		p->keep3 = (dxt == DXT1 && c1 >= c0) ? 0 : ~uint32_t(0);
+		p->bits = cin[4] | (cin[5] << 8) | (cin[6] << 16) | (uint32_t(cin[7]) << 24);
+		if(dxt == DXT5)
+		{
+			p->a0 = in[0];
+			p->a1 = in[1];
+			// 6 and 7 are 0 and 255 if a1 >= a0, otherwise dithered like 2 to 5
+			p->special = -uint32_t(p->a1 >= p->a0);
+			// the 48 index bits as two halves of 8 indices each
+			p->alo = in[2] | (in[3] << 8) | (in[4] << 16);
+			p->ahi = in[5] | (in[6] << 8) | (in[7] << 16);
+		}
+	}
+
+	// the texel k = y * 4 + x of a block; the selects are all-ones/all-zero
+	// masks so the lane loops calling these can be vectorized
+	inline S2TC_ALWAYS_INLINE uint32_t s2tc_color_texel(const s2tc_palette_t &p, int k)
+	{
+		uint32_t idx = (p.bits >> (2 * k)) & 3;
+		uint32_t m0 = -uint32_t(idx == 0);
+		uint32_t m1 = -uint32_t(idx == 1);
+		uint32_t mmid = -uint32_t(idx == 2) | (-uint32_t(idx == 3) & p.keep3);
+		uint32_t mid = ((k ^ (k >> 2)) & 1) ? p.p1 : p.p0;
+		return (p.p0 & m0) | (p.p1 & m1) | (mid & mmid);
+	}
+
+	inline S2TC_ALWAYS_INLINE unsigned char s2tc_alpha_texel_dxt3(const unsigned char *in, int k)
+	{
+		int a = (in[k >> 1] >> (4 * (k & 1))) & 0x0F;
+		return a | (a << 4);
+	}
+
+	inline S2TC_ALWAYS_INLINE unsigned char s2tc_alpha_texel_dxt5(const s2tc_palette_t &p, int k)
+	{
+		uint32_t idx = (((k < 8) ? p.alo : p.ahi) >> (3 * (k & 7))) & 7;
+		uint32_t m0 = -uint32_t(idx == 0);
+		uint32_t m1 = -uint32_t(idx == 1);
+		uint32_t m6 = -uint32_t(idx == 6) & p.special;
+		uint32_t m7 = -uint32_t(idx == 7) & p.special;
+		uint32_t mid = ((k ^ (k >> 2)) & 1) ? p.a1 : p.a0;
+		return (p.a0 & m0) | (p.a1 & m1) | (255 & m7) | (mid & ~(m0 | m1 | m6 | m7));
+	}
+
+	// decodes a block the way the fetch_2d_texel_* functions do, but builds
+	// the palette once and expands all 16 indices in one lane loop
+	template<DxtMode dxt, s2tc_pixel_format_t pf>
+	inline S2TC_ALWAYS_INLINE void s2tc_decode_block_to(const unsigned char *in, unsigned char *out, int pitch)
+	{
+		s2tc_palette_t p;
+		s2tc_palette<dxt, pf>(in, &p);
+
+		uint32_t px[16];
+		int k;
+		for(k = 0; k < 16; ++k)
+			px[k] = s2tc_color_texel(p, k);
+		unsigned char a[16];
+		if(dxt == DXT3)
+		{
+			for(k = 0; k < 16; ++k)
+				a[k] = s2tc_alpha_texel_dxt3(in, k);
+		}
+		else if(dxt == DXT5)
+		{
+			for(k = 0; k < 16; ++k)
+				a[k] = s2tc_alpha_texel_dxt5(p, k);
+		}
+
+		if(pf == S2TC_PIXEL_RGBA8 || pf == S2TC_PIXEL_BGRA8)
+		{
+			for(k = 0; k < 4; ++k)
+				memcpy(out + k * pitch, px + 4 * k, 16);
+			if(dxt != DXT1)
+				for(k = 0; k < 16; ++k)
+					out[(k >> 2) * pitch + (k & 3) * 4 + 3] = a[k];
+		}
+		else
+		{
+			// RGB565 drops the alpha, RGBA5551 keeps its top bit
+			uint16_t px16[16];
+			for(k = 0; k < 16; ++k)
+			{
+				px16[k] = px[k];
+				if(pf == S2TC_PIXEL_RGBA5551 && dxt != DXT1)
+					px16[k] = (px16[k] & ~1) | (a[k] >> 7);
+			}
+			for(k = 0; k < 4; ++k)
+				memcpy(out + k * pitch, px16 + 4 * k, 8);
+		}
+	}
+
+	// fetches the 2x2 texels at (i,j) with the addressing of the
+	// fetch_2d_texel_* functions; lane l is the texel (i + (l & 1), j + (l >> 1))
+	template<DxtMode dxt>
+	inline S2TC_ALWAYS_INLINE void s2tc_fetch_quad_rgba(int srcRowStride, const unsigned char *pixdata, int i, int j, unsigned char *out)
+	{
+		const int blocksize = (dxt == DXT1) ? 8 : 16;
+		int bw = (srcRowStride + 3) >> 2;
+		const unsigned char *blk[4];
+		int k[4];
+		int l;
+		for(l = 0; l < 4; ++l)
+		{
+			int x = i + (l & 1);
+			int y = j + (l >> 1);
+			blk[l] = pixdata + (bw * (y >> 2) + (x >> 2)) * blocksize;
+			k[l] = (y & 3) * 4 + (x & 3);
+		}
+
+		// the footprint spans one, two or four blocks; expand each only once
+		s2tc_palette_t p[4];
+		s2tc_palette<dxt, S2TC_PIXEL_RGBA8>(blk[0], &p[0]);
+		for(l = 1; l < 4; ++l)
+		{
+			if(blk[l] == blk[l - 1])
+				p[l] = p[l - 1];
+			else if(l >= 2 && blk[l] == blk[l - 2])
+				p[l] = p[l - 2];
+			else
+				s2tc_palette<dxt, S2TC_PIXEL_RGBA8>(blk[l], &p[l]);
+		}
+
+		uint32_t px[4];
+		for(l = 0; l < 4; ++l)
+			px[l] = s2tc_color_texel(p[l], k[l]);
+		memcpy(out, px, 16);
+
+		if(dxt == DXT3)
+		{
+			for(l = 0; l < 4; ++l)
+				out[l * 4 + 3] = s2tc_alpha_texel_dxt3(blk[l], k[l]);
+		}
+		else if(dxt == DXT5)
+		{
+			for(l = 0; l < 4; ++l)
+				out[l * 4 + 3] = s2tc_alpha_texel_dxt5(p[l], k[l]);
+		}
+	}
+
+	// decodes the pixels x0 <= x < x1 of the rows y0 <= y < y1 of a block
+	// row to out (the pixel (x0, y0)); blocks the span only partly covers go
+	// through a 4x4 buffer
+	template<DxtMode dxt, s2tc_pixel_format_t pf>
+	void s2tc_decode_span(const unsigned char *in, unsigned char *out, int pitch, int x0, int x1, int y0, int y1)
+	{
+		const int blocksize = (dxt == DXT1) ? 8 : 16;
+		const int bpp = (pf == S2TC_PIXEL_RGBA8 || pf == S2TC_PIXEL_BGRA8) ? 4 : 2;
+		bool full_rows = (y0 == 0 && y1 == 4);
+		for(int bx = x0 & ~3; bx < x1; bx += 4)
+		{
+			const unsigned char *blk = in + (bx / 4) * blocksize;
+			if(full_rows && bx >= x0 && bx + 4 <= x1)
+			{
+				s2tc_decode_block_to<dxt, pf>(blk, out + (bx - x0) * bpp, pitch);
+				continue;
+			}
+			unsigned char block[64];
+			s2tc_decode_block_to<dxt, pf>(blk, block, 4 * bpp);
+			int c0 = max(x0, bx);
+			int c1 = min(x1, bx + 4);
+			for(int y = y0; y < y1; ++y)
+				memcpy(out + (y - y0) * pitch + (c0 - x0) * bpp, block + y * 4 * bpp + (c0 - bx) * bpp, (c1 - c0) * bpp);
+		}
+	}
+
+	typedef void (*s2tc_decode_span_func_t)(const unsigned char *in, unsigned char *out, int pitch, int x0, int x1, int y0, int y1);
+
+	template<s2tc_pixel_format_t pf>
+	s2tc_decode_span_func_t s2tc_decode_span_func(s2tc_format_t format)
+	{
+		switch(format)
+		{
+			case S2TC_FORMAT_DXT1:
+				return s2tc_decode_span<DXT1, pf>;
+			case S2TC_FORMAT_DXT3:
+				return s2tc_decode_span<DXT3, pf>;
+			case S2TC_FORMAT_DXT5:
+				return s2tc_decode_span<DXT5, pf>;
+		}
+		return NULL;
+	}
+};
+
+void s2tc_decode_block(s2tc_format_t format, const unsigned char *src, unsigned char *dest, int dstRowStride)
+{
+	switch(format)
+	{
+		case S2TC_FORMAT_DXT1:
+			s2tc_decode_block_to<DXT1, S2TC_PIXEL_RGBA8>(src, dest, dstRowStride);
+			break;
+		case S2TC_FORMAT_DXT3:
+			s2tc_decode_block_to<DXT3, S2TC_PIXEL_RGBA8>(src, dest, dstRowStride);
+			break;
+		case S2TC_FORMAT_DXT5:
+			s2tc_decode_block_to<DXT5, S2TC_PIXEL_RGBA8>(src, dest, dstRowStride);
+			break;
+	}
+}
+
+void s2tc_fetch_quad(s2tc_format_t format, int srcRowStride, const unsigned char *pixdata, int i, int j, unsigned char *texels)
+{
+	switch(format)
+	{
+		case S2TC_FORMAT_DXT1:
+			s2tc_fetch_quad_rgba<DXT1>(srcRowStride, pixdata, i, j, texels);
+			break;
+		case S2TC_FORMAT_DXT3:
+			s2tc_fetch_quad_rgba<DXT3>(srcRowStride, pixdata, i, j, texels);
+			break;
+		case S2TC_FORMAT_DXT5:
+			s2tc_fetch_quad_rgba<DXT5>(srcRowStride, pixdata, i, j, texels);
+			break;
+	}
+}
+
+int s2tc_decode_rect(int imageWidth, int imageHeight, const unsigned char *src, int srcRowStride,
+		     int x, int y, int width, int height,
+		     s2tc_format_t format, unsigned char *dest, int dstRowStride,
+		     s2tc_pixel_format_t pixelformat)
+{
+	s2tc_decode_span_func_t decode_span;
+	int bpp;
+	switch(pixelformat)
+	{
+		case S2TC_PIXEL_RGBA8:
+			decode_span = s2tc_decode_span_func<S2TC_PIXEL_RGBA8>(format);
+			bpp = 4;
+			break;
+		case S2TC_PIXEL_BGRA8:
+			decode_span = s2tc_decode_span_func<S2TC_PIXEL_BGRA8>(format);
+			bpp = 4;
+			break;
+		case S2TC_PIXEL_RGB565:
+			decode_span = s2tc_decode_span_func<S2TC_PIXEL_RGB565>(format);
+			bpp = 2;
+			break;
+		case S2TC_PIXEL_RGBA5551:
+			decode_span = s2tc_decode_span_func<S2TC_PIXEL_RGBA5551>(format);
+			bpp = 2;
+			break;
+		default:
+			return -1;
+	}
+	if(!decode_span || !src || !dest)
+		return -1;
+	if(x < 0 || y < 0 || width <= 0 || height <= 0 || x + width > imageWidth || y + height > imageHeight)
+		return -1;
+	int blocksize = (format == S2TC_FORMAT_DXT1) ? 8 : 16;
+	if(srcRowStride < ((imageWidth + 3) / 4) * blocksize)
+		srcRowStride = ((imageWidth + 3) / 4) * blocksize;
+	if(dstRowStride < width * bpp)
+		dstRowStride = width * bpp;
+	// only the block rows and columns the rectangle touches are decoded
+	for(int by = y & ~3; by < y + height; by += 4)
+	{
+		int y0 = max(y, by);
+		int y1 = min(y + height, by + 4);
+		decode_span(src + (by / 4) * srcRowStride, dest + (y0 - y) * dstRowStride, dstRowStride, x, x + width, y0 - by, y1 - by);
+	}
+	return 0;
+}
+
+int s2tc_decode_image(int width, int height, const unsigned char *src, int srcRowStride,
+		      s2tc_format_t format, unsigned char *dest, int dstRowStride,
+		      s2tc_pixel_format_t pixelformat)
+{
+	return s2tc_decode_rect(width, height, src, srcRowStride, 0, 0, width, height, format, dest, dstRowStride, pixelformat);
+}
@@ -27,6 +27,9 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include <getopt.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
 
 #ifdef ENABLE_RUNTIME_LINKING
 #include <dlfcn.h>
@@ -43,6 +46,12 @@ fetch_2d_texel_rgb_dxt1_t *fetch_2d_texel_rgb_dxt1 = NULL;
 fetch_2d_texel_rgba_dxt1_t *fetch_2d_texel_rgba_dxt1 = NULL;
 fetch_2d_texel_rgba_dxt3_t *fetch_2d_texel_rgba_dxt3 = NULL;
 fetch_2d_texel_rgba_dxt5_t *fetch_2d_texel_rgba_dxt5 = NULL;
+#include "s2tc.h"
+typedef int (s2tc_decode_rect_t)(int imageWidth, int imageHeight, const unsigned char *src, int srcRowStride,
+		     int x, int y, int width, int height,
+		     s2tc_format_t format, unsigned char *dest, int dstRowStride,
+		     s2tc_pixel_format_t pixelformat);
+s2tc_decode_rect_t *s2tc_decode_rect_ptr = NULL;
 bool load_libraries(const char *n)
 {
 	void *l = dlopen(n, RTLD_NOW);
@@ -61,10 +70,14 @@ bool load_libraries(const char *n)
 		dlclose(l);
 		return false;
 	}
+	/* optional, other libtxc_dxtn implementations lack it */
+	s2tc_decode_rect_ptr = (s2tc_decode_rect_t *) dlsym(l, "s2tc_decode_rect");
 	return true;
 }
 #else
 #include "txc_dxtn.h"
+#include "s2tc.h"
+#define s2tc_decode_rect_ptr s2tc_decode_rect
 #endif
 
 uint32_t LittleLong(uint32_t w)
@@ -82,12 +95,182 @@ uint32_t LittleLong(uint32_t w)
 	return un.u;
 }
 
+/* reads n bytes at offset, so only the needed part of a large file is read;
+ * input that cannot seek is skipped forward from *pos, where stdio stands */
+bool read_at(FILE *fh, off_t *pos, off_t offset, void *buf, size_t n)
+{
+	ssize_t r = pread(fileno(fh), buf, n, offset);
+	if(r == (ssize_t) n)
+		return true;
+	if(r >= 0 || errno != ESPIPE || offset < *pos)
+		return false;
+	while(*pos < offset)
+	{
+		char skip[4096];
+		size_t k = (offset - *pos < (off_t) sizeof(skip)) ? (size_t) (offset - *pos) : sizeof(skip);
+		if(fread(skip, 1, k, fh) != k)
+			return false;
+		*pos += k;
+	}
+	if(fread(buf, 1, n, fh) != n)
+		return false;
+	*pos += n;
+	return true;
+}
+
+typedef void (fetch_t)(GLint srcRowStride, const GLubyte *pixdata, GLint i, GLint j, GLvoid *texel);
+
+/* the rows y0 to y1 of the decoded rectangle, which one thread decodes */
+typedef struct
+{
+	fetch_t *fetch;
+	s2tc_format_t format;
+	const unsigned char *buf;
+	int width, height, pitch;
+	int rx, ry, rw;
+	unsigned char *pic;
+	int y0, y1;
+	pthread_t thread;
+	bool started;
+}
+band_t;
+
+void *decode_band(void *arg)
+{
+	band_t *b = (band_t *) arg;
+	unsigned char *out = b->pic + (size_t) b->y0 * b->rw * 4;
+	if(b->y1 <= b->y0)
+		return NULL;
+#ifdef ENABLE_RUNTIME_LINKING
+	if(!s2tc_decode_rect_ptr)
+	{
+		int x, y;
+		for(y = b->ry + b->y0; y < b->ry + b->y1; ++y)
+			for(x = b->rx; x < b->rx + b->rw; ++x, out += 4)
+			{
+				unsigned char h;
+				b->fetch(b->width, b->buf, x, y, out);
+				h = out[0];
+				out[0] = out[2];
+				out[2] = h;
+			}
+		return NULL;
+	}
+#endif
+	/* TGA wants BGRA, so no swapping is needed */
+	s2tc_decode_rect_ptr(b->width, b->height, b->buf, b->pitch, b->rx, b->ry + b->y0, b->rw, b->y1 - b->y0,
+			b->format, out, b->rw * 4, S2TC_PIXEL_BGRA8);
+	return NULL;
+}
+
+/* decodes the rectangle (rx, ry, rw, rh) of a width*height mip level at offset,
+ * spreading its block rows over threads, and writes it as TGA */
+bool decompress_level(FILE *infh, off_t *pos, off_t offset, int width, int height,
+		fetch_t *fetch, s2tc_format_t format, int blocksize,
+		int rx, int ry, int rw, int rh, int threads, FILE *outfh)
+{
+	unsigned char t[18];
+	unsigned char *buf, *pic;
+	band_t *bands;
+	int pitch, by0, by1, i;
+
+	/* only the block rows the rectangle touches are read */
+	pitch = ((width + 3) / 4) * blocksize;
+	by0 = ry / 4;
+	by1 = (ry + rh + 3) / 4;
+	buf = (unsigned char *) malloc((size_t) (by1 - by0) * pitch);
+	if(!buf || !read_at(infh, pos, offset + (off_t) by0 * pitch, buf, (size_t) (by1 - by0) * pitch))
+	{
+		fprintf(stderr, "reading the texture failed\n");
+		return false;
+	}
+	height = (height - by0 * 4 < (by1 - by0) * 4) ? height - by0 * 4 : (by1 - by0) * 4;
+	ry -= by0 * 4;
+
+	pic = (unsigned char *) malloc((size_t) rw * rh * 4);
+	if(threads > by1 - by0)
+		threads = by1 - by0;
+	bands = (band_t *) calloc(threads, sizeof(*bands));
+	if(!pic || !bands)
+	{
+		fprintf(stderr, "out of memory\n");
+		return false;
+	}
+	/* the bands start at block row boundaries, so no block is decoded twice */
+	for(i = 0; i < threads; ++i)
+	{
+		band_t *b = &bands[i];
+		b->fetch = fetch;
+		b->format = format;
+		b->buf = buf;
+		b->width = width;
+		b->height = height;
+		b->pitch = pitch;
+		b->rx = rx;
+		b->ry = ry;
+		b->rw = rw;
+		b->pic = pic;
+		b->y0 = ((by1 - by0) * i / threads) * 4 - ry;
+		b->y1 = ((by1 - by0) * (i + 1) / threads) * 4 - ry;
+		if(b->y0 < 0)
+			b->y0 = 0;
+		if(b->y1 > rh)
+			b->y1 = rh;
+		if(i > 0)
+			b->started = !pthread_create(&b->thread, NULL, decode_band, b);
+	}
+	/* the first band, and any the system has no thread for, are decoded here */
+	for(i = 0; i < threads; ++i)
+		if(!bands[i].started)
+			decode_band(&bands[i]);
+	for(i = 1; i < threads; ++i)
+		if(bands[i].started)
+			pthread_join(bands[i].thread, NULL);
+
+	memset(t, 0, 18);
+	t[2]  = 2;
+	t[12] = rw % 256;
+	t[13] = rw / 256;
+	t[14] = rh % 256;
+	t[15] = rh / 256;
+	t[16] = 32;
+	t[17] = 0x28;
+	fwrite(t, 18, 1, outfh);
+	fwrite(pic, (size_t) rw * 4, rh, outfh);
+
+	free(bands);
+	free(pic);
+	free(buf);
+	return true;
+}
+
+/* opens the output file for a mip level; the first %d in the name is replaced by the level */
+FILE *open_output(const char *name, int level)
+{
+	const char *p = strstr(name, "%d");
+	char *n;
+	FILE *fh;
+	if(!p)
+		return fopen(name, "wb");
+	n = (char *) malloc(strlen(name) + 16);
+	if(!n)
+		return NULL;
+	sprintf(n, "%.*s%d%s", (int) (p - name), name, level, p + 2);
+	fh = fopen(n, "wb");
+	free(n);
+	return fh;
+}
+
 int usage(const char *me)
 {
 	fprintf(stderr, "usage:\n"
 			"%s \n"
 			"    [-i infile.tga]\n"
 			"    [-o outfile.dds]\n"
+			"    [-m miplevel]\n"
+			"    [-a (all mip levels, to the files named by -o with %%d replaced by the level)]\n"
+			"    [-r x,y,width,height]\n"
+			"    [-j threads]\n"
 #ifdef ENABLE_RUNTIME_LINKING
 			"    [-l path_to_libtxc_dxtn.so]\n"
 #endif
@@ -101,16 +284,18 @@ int main(int argc, char **argv)
 	const char *infile = NULL, *outfile = NULL;
 	FILE *infh, *outfh;
 	uint32_t h[32];
-	int x, y, width, height, n;
-	unsigned char t[18];
-	unsigned char *buf;
+	int width, height, l, levels;
+	int level = 0, rx = 0, ry = 0, rw = -1, rh = -1;
+	bool all_levels = false, rect = false;
+	int threads = 0;
+	off_t offset, pos;
 
 #ifdef ENABLE_RUNTIME_LINKING
 	const char *library = "libtxc_dxtn.so";
 #endif
 
 	int opt;
-	while((opt = getopt(argc, argv, "i:o:"
+	while((opt = getopt(argc, argv, "i:o:m:ar:j:"
 #ifdef ENABLE_RUNTIME_LINKING
 					"l:"
 #endif
@@ -124,6 +309,20 @@ int main(int argc, char **argv)
 			case 'o':
 				outfile = optarg;
 				break;
+			case 'm':
+				level = atoi(optarg);
+				break;
+			case 'a':
+				all_levels = true;
+				break;
+			case 'r':
+				if(sscanf(optarg, "%d,%d,%d,%d", &rx, &ry, &rw, &rh) != 4)
+					return usage(argv[0]);
+				rect = true;
+				break;
+			case 'j':
+				threads = atoi(optarg);
+				break;
 #ifdef ENABLE_RUNTIME_LINKING
 			case 'l':
 				library = optarg;
@@ -138,6 +337,15 @@ int main(int argc, char **argv)
 	if(!load_libraries(library))
 		return 1;
 #endif
+	if(all_levels && (rect || !outfile || !strstr(outfile, "%d")))
+	{
+		fprintf(stderr, "-a needs -o with %%d in the file name and cannot be combined with -r\n");
+		return usage(argv[0]);
+	}
+	if(threads <= 0)
+		threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if(threads <= 0)
+		threads = 1;
 
 	infh = infile ? fopen(infile, "rb") : stdin;
 	if(!infh)
@@ -146,69 +354,89 @@ int main(int argc, char **argv)
 		return 2;
 	}
 
-	outfh = outfile ? fopen(outfile, "wb") : stdout;
-	if(!outfh)
-	{
-		printf("opening output failed\n");
-		return 2;
-	}
-
 	fread(h, sizeof(h), 1, infh);
+	pos = sizeof(h);
 	height = LittleLong(h[3]);
 	width = LittleLong(h[4]);
 
-	void (*fetch)(GLint srcRowStride, const GLubyte *pixdata, GLint i, GLint j, GLvoid *texel) = NULL;
+	levels = LittleLong(h[7]);
+	if(levels < 1)
+		levels = 1;
+
+	fetch_t *fetch = NULL;
 	int fourcc = LittleLong(h[21]);
 	int blocksize;
+	s2tc_format_t format;
 	switch(fourcc)
 	{
 		case 0x31545844:
 			fetch = fetch_2d_texel_rgba_dxt1;
 			blocksize = 8;
+			format = S2TC_FORMAT_DXT1;
 			break;
 		case 0x33545844:
 			fetch = fetch_2d_texel_rgba_dxt3;
 			blocksize = 16;
+			format = S2TC_FORMAT_DXT3;
 			break;
 		case 0x35545844:
 			fetch = fetch_2d_texel_rgba_dxt5;
 			blocksize = 16;
+			format = S2TC_FORMAT_DXT5;
 			break;
 		default:
 			fprintf(stderr, "Only DXT1, DXT3, DXT5 are supported!\n");
 			return 1;
 	}
 
-	memset(t, 0, 18);
-	t[2]  = 2;
-	t[12] = width % 256;
-	t[13] = width / 256;
-	t[14] = height % 256;
-	t[15] = height / 256;
-	t[16] = 32;
-	t[17] = 0x28;
-	fwrite(t, 18, 1, outfh);
-
-	n = ((width + 3) / 4) * ((height + 3) / 4);
-	buf = (unsigned char *) malloc(n * blocksize);
-	fread(buf, blocksize, n, infh);
+	if(level < 0 || level >= levels)
+	{
+		fprintf(stderr, "The file has only %d mip levels!\n", levels);
+		return 1;
+	}
 
-	for(y = 0; y < height; ++y)
-		for(x = 0; x < width; ++x)
+	/* the levels follow the header one after another */
+	offset = 128;
+	for(l = 0; l < levels; ++l)
+	{
+		int lw = (width >> l) ? (width >> l) : 1;
+		int lh = (height >> l) ? (height >> l) : 1;
+		if(all_levels || l == level)
 		{
-			char data[4];
-			char h;
-			fetch(width, buf, x, y, &data);
-			h = data[0];
-			data[0] = data[2];
-			data[2] = h;
-			fwrite(data, 4, 1, outfh);
+			if(!rect)
+			{
+				rx = ry = 0;
+				rw = lw;
+				rh = lh;
+			}
+			if(rw < 0)
+				rw = lw - rx;
+			if(rh < 0)
+				rh = lh - ry;
+			if(rx < 0 || ry < 0 || rw <= 0 || rh <= 0 || rx + rw > lw || ry + rh > lh)
+			{
+				fprintf(stderr, "The rectangle is outside the %dx%d mip level!\n", lw, lh);
+				return 1;
+			}
+
+			outfh = outfile ? open_output(outfile, l) : stdout;
+			if(!outfh)
+			{
+				printf("opening output failed\n");
+				return 2;
+			}
+			if(!decompress_level(infh, &pos, offset, lw, lh, fetch, format, blocksize, rx, ry, rw, rh, threads, outfh))
+				return 1;
+			if(outfile)
+				fclose(outfh);
+			if(!all_levels)
+				break;
 		}
+		offset += (off_t) ((lw + 3) / 4) * ((lh + 3) / 4) * blocksize;
+	}
 
 	if(infile)
 		fclose(infh);
-	if(outfile)
-		fclose(outfh);
 
 	return 0;
 }
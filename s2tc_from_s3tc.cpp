@@ -24,10 +24,17 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <stdint.h>
 #include <getopt.h>
-#include <algorithm>
-#include "s2tc_common.h"
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "s2tc.h"
 
 uint32_t LittleLong(uint32_t w)
 {
@@ -50,151 +57,298 @@ int usage(const char *me)
 			"%s \n"
 			"    [-i infile.dds]\n"
 			"    [-o outfile.dds]\n"
+			"    [-d directory (converts all .dds files below it in place)]\n"
+			"    [-j threads]\n"
+			"    [-q (decode the blocks and pick the colors by S2TC_COLORDIST_MODE and S2TC_REFINE_COLORS)]\n"
 			,
 			me);
 	return 1;
 }
 
-enum DxtConversion
+struct convert_job_t
 {
-	DXT1,
-	DXT3,
-	DXT5
+	s2tc_format_t format;
+	const unsigned char *in;
+	unsigned char *out;
+	size_t n;
+	pthread_t thread;
+	bool started;
 };
 
-//pixels = (pixels & ~((~pixels & 0x55555555) << 1)) | ((pixels & 0x22882288) >> 1);
-// 00 -> 00
-// 01 -> 01
-// 10 -> 00 or 01
-// 11 -> 11
+void *convert_job(void *arg)
+{
+	convert_job_t *job = (convert_job_t *) arg;
+	s2tc_transcode_from_s3tc(job->in, job->out, job->n, job->format);
+	return NULL;
+}
 
-//pixels = (pixels & ((~pixels & 0xAAAAAAAA) >> 1)) | ((pixels & 0x22882288) >> 1);
-// 00 -> 00
-// 01 -> 01
-// 10 -> 00 or 01
-// 11 -> 00 or 01
+// splitting smaller files across threads costs more than it saves
+const size_t blocks_per_thread = 16384;
 
-void convert_dxt1(unsigned char *buf)
+void convert_parallel(s2tc_format_t format, const unsigned char *in, unsigned char *out, size_t n, int threads)
 {
-	unsigned int c  = buf[0] + 256*buf[1];
-	unsigned int c1 = buf[2] + 256*buf[3];
-	uint32_t pixels = buf[4] | (((uint32_t)buf[5]) << 8) | (((uint32_t)buf[6]) << 16) | (((uint32_t)buf[7]) << 24);
-	if(c1 >= c)
+	const size_t blocksize = (format == S2TC_FORMAT_DXT1) ? 8 : 16;
+	if((size_t) threads > n / blocks_per_thread)
+		threads = n / blocks_per_thread;
+	if(threads < 1)
+		threads = 1;
+	convert_job_t one;
+	convert_job_t *jobs = (threads > 1) ? (convert_job_t *) malloc(threads * sizeof(*jobs)) : NULL;
+	if(!jobs)
 	{
-		// we have 10, 11 "cannot be", but we better treat 11 the same way as 10 here
-		pixels = (pixels & ((~pixels & 0xAAAAAAAA) >> 1)) | ((pixels & 0x22882288) >> 1);
-
-		// S2TC conformance: always use the same order of c, c1
-		// swap
-		std::swap(c1, c);
-		// invert
-		pixels ^= 0x55555555;
+		jobs = &one;
+		threads = 1;
 	}
-	else
+	for(int i = 0; i < threads; ++i)
 	{
-		// we have no alpha
-		pixels = (pixels & ((~pixels & 0xAAAAAAAA) >> 1)) | ((pixels & 0x22882288) >> 1);
-		// alternatively: collapse
-		//pixels = pixels & 0x55555555;
+		size_t b0 = n * i / threads;
+		size_t b1 = n * (i + 1) / threads;
+		jobs[i].format = format;
+		jobs[i].in = in + b0 * blocksize;
+		jobs[i].out = out + b0 * blocksize;
+		jobs[i].n = b1 - b0;
+		jobs[i].started = i > 0 && !pthread_create(&jobs[i].thread, NULL, convert_job, &jobs[i]);
 	}
-	buf[0] = c & 0xFF;
-	buf[1] = c >> 8;
-	buf[2] = c1 & 0xFF;
-	buf[3] = c1 >> 8;
-	buf[4] = pixels & 0xFF;
-	buf[5] = (pixels >> 8) & 0xFF;
-	buf[6] = (pixels >> 16) & 0xFF;
-	buf[7] = (pixels >> 24) & 0xFF;
+	// the first part, and any the system has no thread for, are converted here
+	for(int i = 0; i < threads; ++i)
+		if(!jobs[i].started)
+			convert_job(&jobs[i]);
+	for(int i = 1; i < threads; ++i)
+		if(jobs[i].started)
+			pthread_join(jobs[i].thread, NULL);
+	if(jobs != &one)
+		free(jobs);
 }
 
-void convert_dxt1a(unsigned char *buf)
+// maps a regular file, or reads anything else (like a pipe) into memory
+unsigned char *read_input(int fd, size_t *size, bool *mapped)
 {
-	unsigned int c  = buf[0] + 256*buf[1];
-	unsigned int c1 = buf[2] + 256*buf[3];
-	uint32_t pixels = buf[4] | (((uint32_t)buf[5]) << 8) | (((uint32_t)buf[6]) << 16) | (((uint32_t)buf[7]) << 24);
-	if(c1 >= c)
+	struct stat st;
+	*mapped = false;
+	if(!fstat(fd, &st) && S_ISREG(st.st_mode) && st.st_size > 0)
 	{
-		// we have alpha, don't break it
-		pixels = (pixels & ~((~pixels & 0x55555555) << 1)) | ((pixels & 0x22882288) >> 1);
+		void *p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if(p != MAP_FAILED)
+		{
+			*size = st.st_size;
+			*mapped = true;
+			return (unsigned char *) p;
+		}
 	}
-	else
+	size_t n = 0, cap = 1 << 20;
+	unsigned char *buf = (unsigned char *) malloc(cap);
+	for(;;)
 	{
-		// we have no alpha
-		pixels = (pixels & ((~pixels & 0xAAAAAAAA) >> 1)) | ((pixels & 0x22882288) >> 1);
-		// alternatively: collapse
-		//pixels = pixels & 0x55555555;
+		if(!buf)
+			return NULL;
+		ssize_t r = read(fd, buf + n, cap - n);
+		if(r < 0 && errno == EINTR)
+			continue;
+		if(r < 0)
+		{
+			free(buf);
+			return NULL;
+		}
+		if(r == 0)
+			break;
+		n += r;
+		if(n == cap)
+		{
+			cap *= 2;
+			unsigned char *b = (unsigned char *) realloc(buf, cap);
+			if(!b)
+				free(buf);
+			buf = b;
+		}
+	}
+	*size = n;
+	return buf;
+}
 
-		// S2TC conformance: always use the same order of c, c1
-		// swap
-		std::swap(c1, c);
-		// invert
-		pixels ^= 0x55555555;
+bool write_all(int fd, const unsigned char *buf, size_t n)
+{
+	while(n > 0)
+	{
+		ssize_t r = write(fd, buf, n);
+		if(r < 0 && errno == EINTR)
+			continue;
+		if(r <= 0)
+			return false;
+		buf += r;
+		n -= r;
 	}
-	buf[0] = c & 0xFF;
-	buf[1] = c >> 8;
-	buf[2] = c1 & 0xFF;
-	buf[3] = c1 >> 8;
-	buf[4] = pixels & 0xFF;
-	buf[5] = (pixels >> 8) & 0xFF;
-	buf[6] = (pixels >> 16) & 0xFF;
-	buf[7] = (pixels >> 24) & 0xFF;
+	return true;
 }
 
-void convert_dxt5(unsigned char *buf)
+// converts infile (NULL: stdin) to outfile (NULL: stdout)
+// ctx: if not NULL, the blocks are requantized by its settings on its threads
+// returns 0 on success, 1 for unsupported input, 2 for I/O or requantizing errors
+int convert_file(const char *infile, const char *outfile, int threads, s2tc_context_t *ctx)
 {
-	unsigned int a  = buf[0];
-	unsigned int a1 = buf[1];
-	uint64_t pixels = buf[2] | (((uint32_t)buf[3]) << 8) | (((uint32_t)buf[4]) << 16) | (((uint32_t)buf[5]) << 24) | (((uint64_t)buf[6]) << 32) | (((uint64_t)buf[7]) << 40);
-	if(a1 >= a)
+	int infd = infile ? open(infile, O_RDONLY) : 0;
+	if(infd < 0)
+	{
+		fprintf(stderr, "opening input failed\n");
+		return 2;
+	}
+	size_t size;
+	bool in_mapped;
+	unsigned char *in = read_input(infd, &size, &in_mapped);
+	if(infile)
+		close(infd);
+	if(!in)
 	{
-		// we want to map:
-		// 000 -> 000
-		// 001 -> 001
-		// 010 -> 000 or 001
-		// 011 -> 000 or 001
-		// 100 -> 001 or 000
-		// 101 -> 001 or 000
-		// 110 -> 110
-		// 111 -> 111
+		fprintf(stderr, "reading input failed\n");
+		return 2;
+	}
 
-		pixels = (pixels & ~((((pixels >> 1) ^ (pixels >> 2)) & 01111111111111111ull) * 7)) | (((pixels >> 1) ^ (pixels >> 2)) & 00101101001011010ull);
+	uint32_t h[32];
+	int fourcc = 0;
+	if(size >= sizeof(h))
+	{
+		memcpy(h, in, sizeof(h));
+		fourcc = LittleLong(h[21]);
+	}
+	size_t blocksize;
+	s2tc_format_t format;
+	switch(fourcc)
+	{
+		case 0x31545844:
+			blocksize = 8;
+			format = S2TC_FORMAT_DXT1;
+			break;
+		case 0x33545844:
+			blocksize = 16;
+			format = S2TC_FORMAT_DXT3;
+			break;
+		case 0x35545844:
+			blocksize = 16;
+			format = S2TC_FORMAT_DXT5;
+			break;
+		default:
+			fprintf(stderr, "Only DXT1, DXT3, DXT5 are supported!\n");
+			if(in_mapped)
+				munmap(in, size);
+			else
+				free(in);
+			return 1;
+	}
+
+	// everything behind the header is blocks (all mip levels), a partial block at the end is dropped
+	size_t nblocks = (size - sizeof(h)) / blocksize;
+	size_t outsize = sizeof(h) + nblocks * blocksize;
+	int outfd = outfile ? open(outfile, O_RDWR | O_CREAT | O_TRUNC, 0666) : 1;
+	if(outfd < 0)
+	{
+		fprintf(stderr, "opening output failed\n");
+		if(in_mapped)
+			munmap(in, size);
+		else
+			free(in);
+		return 2;
+	}
+	unsigned char *out = NULL;
+	bool out_mapped = false;
+	if(outfile && !ftruncate(outfd, outsize))
+	{
+		void *p = mmap(NULL, outsize, PROT_READ | PROT_WRITE, MAP_SHARED, outfd, 0);
+		if(p != MAP_FAILED)
+		{
+			out = (unsigned char *) p;
+			out_mapped = true;
+		}
+	}
+	if(!out)
+		out = in_mapped ? (unsigned char *) malloc(outsize) : in;
+
+	int ret = 0;
+	if(!out)
+	{
+		fprintf(stderr, "out of memory\n");
+		ret = 2;
 	}
 	else
 	{
-		// we want to map:
-		// 000 -> 000
-		// 001 -> 001
-		// 010 -> 000 or 001
-		// 011 -> 000 or 001
-		// 100 -> 000 or 001
-		// 101 -> 001 or 000
-		// 110 -> 001 or 000
-		// 111 -> 001 or 000
+		memmove(out, in, sizeof(h));
+		if(ctx)
+		{
+			if(s2tc_requantize_from_s3tc(ctx, in + sizeof(h), out + sizeof(h), nblocks, format))
+			{
+				fprintf(stderr, "requantizing failed\n");
+				ret = 2;
+			}
+		}
+		else
+			convert_parallel(format, in + sizeof(h), out + sizeof(h), nblocks, threads);
+		if(out_mapped)
+		{
+			if(munmap(out, outsize) && !ret)
+			{
+				fprintf(stderr, "writing output failed\n");
+				ret = 2;
+			}
+		}
+		else if(!ret && !write_all(outfd, out, outsize))
+		{
+			fprintf(stderr, "writing output failed\n");
+			ret = 2;
+		}
+	}
+	if(outfile && close(outfd))
+		ret = 2;
+	// never leave a partial output file behind
+	if(ret && outfile)
+		unlink(outfile);
+
+	if(out && !out_mapped && out != in)
+		free(out);
+	if(in_mapped)
+		munmap(in, size);
+	else
+		free(in);
+	return ret;
+}
 
-		pixels = (pixels & ~((((pixels >> 1) | (pixels >> 2)) & 01111111111111111ull) * 7)) | (((pixels >> 1) | (pixels >> 2)) & 00101101001011010ull);
+// directory mode: every .dds file below the directory is converted in place
+int dir_threads;
+s2tc_context_t *dir_ctx;
+int dir_status;
 
-		// S2TC conformance: always use the same order of a, a1
-		// swap
-		std::swap(a1, a);
-		// invert
-		pixels ^= 01111111111111111ull;
+int convert_tree_entry(const char *path, const struct stat *, int type, struct FTW *)
+{
+	size_t l = strlen(path);
+	if(type != FTW_F || l < 4 || strcasecmp(path + l - 4, ".dds"))
+		return 0;
+	// written next to the original and renamed over it
+	char *tmp = (char *) malloc(l + 16);
+	if(!tmp)
+	{
+		dir_status = 2;
+		return 1;
 	}
-	buf[0] = a;
-	buf[1] = a1;
-	buf[2] = pixels & 0xFF;
-	buf[3] = (pixels >> 8) & 0xFF;
-	buf[4] = (pixels >> 16) & 0xFF;
-	buf[5] = (pixels >> 24) & 0xFF;
-	buf[6] = (pixels >> 32) & 0xFF;
-	buf[7] = (pixels >> 40) & 0xFF;
+	sprintf(tmp, "%s.s2tc-tmp", path);
+	int r = convert_file(path, tmp, dir_threads, dir_ctx);
+	if(!r && rename(tmp, path))
+		r = 2;
+	if(r)
+	{
+		unlink(tmp);
+		fprintf(stderr, "%s: not converted\n", path);
+		if(r > dir_status)
+			dir_status = r;
+	}
+	free(tmp);
+	return 0;
 }
 
 int main(int argc, char **argv)
 {
-	const char *infile = NULL, *outfile = NULL;
+	const char *infile = NULL, *outfile = NULL, *dir = NULL;
+	int threads = 0;
+	bool requantize = false;
 
 	int opt;
-	while((opt = getopt(argc, argv, "i:o:")) != -1)
+	while((opt = getopt(argc, argv, "i:o:d:j:q")) != -1)
 	{
 		switch(opt)
 		{
@@ -204,68 +358,59 @@ int main(int argc, char **argv)
 			case 'o':
 				outfile = optarg;
 				break;
+			case 'd':
+				dir = optarg;
+				break;
+			case 'j':
+				threads = atoi(optarg);
+				break;
+			case 'q':
+				requantize = true;
+				break;
 			default:
 				return usage(argv[0]);
 				break;
 		}
 	}
+	if(threads <= 0)
+		threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if(threads <= 0)
+		threads = 1;
 
-	FILE *infh = infile ? fopen(infile, "rb") : stdin;
-	if(!infh)
-	{
-		printf("opening input failed\n");
-		return 2;
-	}
-
-	FILE *outfh = outfile ? fopen(outfile, "wb") : stdout;
-	if(!outfh)
-	{
-		printf("opening output failed\n");
-		return 2;
-	}
-
-	uint32_t h[32];
-	fread(h, sizeof(h), 1, infh);
-
-	int fourcc = LittleLong(h[21]);
-	int blocksize;
-	DxtConversion mode;
-	switch(fourcc)
+	s2tc_context_t *ctx = NULL;
+	if(requantize)
 	{
-		case 0x31545844:
-			blocksize = 8;
-			mode = DXT1;
-			break;
-		case 0x33545844:
-			blocksize = 16;
-			mode = DXT3;
-			break;
-		case 0x35545844:
-			blocksize = 16;
-			mode = DXT5;
-			break;
-		default:
-			fprintf(stderr, "Only DXT1, DXT3, DXT5 are supported!\n");
-			return 1;
+		s2tc_config_t config;
+		s2tc_config_init(&config);
+		s2tc_config_from_env(&config);
+		config.threads = threads;
+		ctx = s2tc_context_create(&config);
+		if(!ctx)
+		{
+			fprintf(stderr, "out of memory\n");
+			return 2;
+		}
 	}
 
-	fwrite(h, sizeof(h), 1, outfh);
-	unsigned char buf[16];
-	while(fread(buf, blocksize, 1, infh) > 0)
+	int ret;
+	if(dir)
 	{
-		if(mode == DXT1)
-			convert_dxt1a(buf);
+		if(infile || outfile)
+			return usage(argv[0]);
+		dir_threads = threads;
+		dir_ctx = ctx;
+		if(nftw(dir, convert_tree_entry, 16, FTW_PHYS))
+		{
+			fprintf(stderr, "walking %s failed\n", dir);
+			ret = 2;
+		}
 		else
-			convert_dxt1(buf + 8);
-		if(mode == DXT5)
-			convert_dxt5(buf);
-		fwrite(buf, blocksize, 1, outfh);
+			ret = dir_status;
 	}
+	else
+		ret = convert_file(infile, outfile, threads, ctx);
 
-	if(infile)
-		fclose(infh);
-	if(outfile)
-		fclose(outfh);
-
-	return 0;
+	if(ctx)
+		s2tc_context_destroy(ctx);
+	return ret;
 }
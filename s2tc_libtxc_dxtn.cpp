@@ -29,15 +29,106 @@ extern "C"
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <pthread.h>
+#include "s2tc.h"
 #include "s2tc_algorithm.h"
 #include "s2tc_common.h"
 
+namespace
+{
+	// optional per-thread cache of decoded blocks for the fetch functions;
+	// software rasterizers fetch in scanline order and so hit the same block
+	// up to 16 times in a row
+	pthread_once_t fetch_cache_once = PTHREAD_ONCE_INIT;
+	int fetch_cache_enabled = -1; // -1 until S2TC_FETCH_CACHE was read
+	// bumped by s2tc_fetch_cache_invalidate; entries of older generations are stale
+	volatile unsigned int fetch_cache_generation;
+	// each thread's cache is allocated on its first cached fetch and freed
+	// when the thread exits, so threads that never use it cost nothing
+	pthread_key_t fetch_cache_key;
+	bool fetch_cache_have_key;
+
+	void fetch_cache_init()
+	{
+		const char *v = getenv("S2TC_FETCH_CACHE");
+		fetch_cache_have_key = !pthread_key_create(&fetch_cache_key, free);
+		fetch_cache_enabled = v ? !!atoi(v) : 0;
+	}
+
+	inline bool fetch_cache_active()
+	{
+		if(fetch_cache_enabled < 0)
+			pthread_once(&fetch_cache_once, fetch_cache_init);
+		return fetch_cache_enabled > 0;
+	}
+
+	struct fetch_cache_entry_t
+	{
+		const GLubyte *block;
+		s2tc_format_t format;
+		unsigned int generation;
+		unsigned char rgba[64];
+	};
+	// direct mapped by block address; scanline order comes back to a block
+	// one block row later, so this holds a block row of textures up to 1024
+	// pixels wide
+	const int fetch_cache_size = 256;
+
+	// returns the texel (i,j) of the block at blksrc, decoding the block on a miss
+	// returns NULL if the thread has no cache and none can be allocated
+	inline const unsigned char *fetch_cache_texel(s2tc_format_t format, const GLubyte *blksrc, int blocksize, GLint i, GLint j)
+	{
+		if(!fetch_cache_have_key)
+			return NULL;
+		fetch_cache_entry_t *cache = (fetch_cache_entry_t *) pthread_getspecific(fetch_cache_key);
+		if(!cache)
+		{
+			cache = (fetch_cache_entry_t *) calloc(fetch_cache_size, sizeof(*cache));
+			if(!cache)
+				return NULL;
+			if(pthread_setspecific(fetch_cache_key, cache))
+			{
+				free(cache);
+				return NULL;
+			}
+		}
+		fetch_cache_entry_t *e = &cache[((size_t) blksrc / blocksize) & (fetch_cache_size - 1)];
+		unsigned int generation = fetch_cache_generation;
+		if(e->block != blksrc || e->format != format || e->generation != generation)
+		{
+			s2tc_decode_block(format, blksrc, e->rgba, 16);
+			e->block = blksrc;
+			e->format = format;
+			e->generation = generation;
+		}
+		return e->rgba + ((j & 3) * 4 + (i & 3)) * 4;
+	}
+};
+
+void s2tc_fetch_cache_enable(int enable)
+{
+	pthread_once(&fetch_cache_once, fetch_cache_init);
+	fetch_cache_enabled = !!enable;
+}
+
+void s2tc_fetch_cache_invalidate(void)
+{
+	__sync_fetch_and_add(&fetch_cache_generation, 1);
+}
+
 void fetch_2d_texel_rgb_dxt1(GLint srcRowStride, const GLubyte *pixdata,
 			     GLint i, GLint j, GLvoid *texel)
 {
 	// fetches a single texel (i,j) into pixdata (RGB)
 	GLubyte *t = (GLubyte *) texel;
 	const GLubyte *blksrc = (pixdata + (((srcRowStride + 3) >> 2) * (j >> 2) + (i >> 2)) * 8);
+	const unsigned char *cached;
+	if(fetch_cache_active() && (cached = fetch_cache_texel(S2TC_FORMAT_DXT1, blksrc, 8, i, j)))
+	{
+		memcpy(t, cached, 4);
+		t[3] = 255;
+		return;
+	}
 	unsigned int c  = blksrc[0] + 256*blksrc[1];
 	unsigned int c1 = blksrc[2] + 256*blksrc[3];
 	int b = (blksrc[4 + (j & 3)] >> (2 * (i & 3))) & 0x03;
@@ -60,6 +151,12 @@ void fetch_2d_texel_rgba_dxt1(GLint srcRowStride, const GLubyte *pixdata,
 	// fetches a single texel (i,j) into pixdata (RGBA)
 	GLubyte *t = (GLubyte *) texel;
 	const GLubyte *blksrc = (pixdata + (((srcRowStride + 3) >> 2) * (j >> 2) + (i >> 2)) * 8);
+	const unsigned char *cached;
+	if(fetch_cache_active() && (cached = fetch_cache_texel(S2TC_FORMAT_DXT1, blksrc, 8, i, j)))
+	{
+		memcpy(t, cached, 4);
+		return;
+	}
 	unsigned int c  = blksrc[0] + 256*blksrc[1];
 	unsigned int c1 = blksrc[2] + 256*blksrc[3];
 	int b = (blksrc[4 + (j & 3)] >> (2 * (i & 3))) & 0x03;
@@ -81,6 +178,12 @@ void fetch_2d_texel_rgba_dxt3(GLint srcRowStride, const GLubyte *pixdata,
 	// fetches a single texel (i,j) into pixdata (RGBA)
 	GLubyte *t = (GLubyte *) texel;
 	const GLubyte *blksrc = (pixdata + (((srcRowStride + 3) >> 2) * (j >> 2) + (i >> 2)) * 16);
+	const unsigned char *cached;
+	if(fetch_cache_active() && (cached = fetch_cache_texel(S2TC_FORMAT_DXT3, blksrc, 16, i, j)))
+	{
+		memcpy(t, cached, 4);
+		return;
+	}
 	unsigned int c  = blksrc[8] + 256*blksrc[9];
 	unsigned int c1 = blksrc[10] + 256*blksrc[11];
 	int b = (blksrc[12 + (j & 3)] >> (2 * (i & 3))) & 0x03;
@@ -103,6 +206,12 @@ void fetch_2d_texel_rgba_dxt5(GLint srcRowStride, const GLubyte *pixdata,
 	// fetches a single texel (i,j) into pixdata (RGBA)
 	GLubyte *t = (GLubyte *) texel;
 	const GLubyte *blksrc = (pixdata + (((srcRowStride + 3) >> 2) * (j >> 2) + (i >> 2)) * 16);
+	const unsigned char *cached;
+	if(fetch_cache_active() && (cached = fetch_cache_texel(S2TC_FORMAT_DXT5, blksrc, 16, i, j)))
+	{
+		memcpy(t, cached, 4);
+		return;
+	}
 	unsigned int c  = blksrc[8] + 256*blksrc[9];
 	unsigned int c1 = blksrc[10] + 256*blksrc[11];
 	int b = (blksrc[12 + (j & 3)] >> (2 * (i & 3))) & 0x03;
@@ -139,161 +248,52 @@ void fetch_2d_texel_rgba_dxt5(GLint srcRowStride, const GLubyte *pixdata,
 	t[3] = a;
 }
 
-void tx_compress_dxtn(GLint srccomps, GLint width, GLint height,
-		      const GLubyte *srcPixData, GLenum destformat,
-		      GLubyte *dest, GLint dstRowStride)
+namespace
 {
-	// compresses width*height pixels (RGB or RGBA depending on srccomps) at srcPixData (packed) to destformat (dest, dstRowStride)
-
-	GLubyte *blkaddr = dest;
-	GLint numxpixels, numypixels;
-	GLint i, j;
-	GLint dstRowDiff;
-	unsigned char *rgba = (unsigned char *) malloc(width * height * 4);
-	unsigned char *srcaddr;
-	DxtMode dxt;
+	// tx_compress_dxtn settings, read from the environment on first use
+	pthread_once_t default_context_once = PTHREAD_ONCE_INIT;
+	s2tc_context_t *default_context;
 
-	ColorDistMode cd = WAVG;
-	int nrandom = -1;
-	RefinementMode refine = REFINE_ALWAYS;
-	DitherMode dither = DITHER_SIMPLE;
+	void default_context_create()
 	{
-		const char *v = getenv("S2TC_DITHER_MODE");
-		if(v)
-		{
-			if(!strcasecmp(v, "NONE"))
-				dither = DITHER_NONE;
-			else if(!strcasecmp(v, "SIMPLE"))
-				dither = DITHER_SIMPLE;
-			else if(!strcasecmp(v, "FLOYDSTEINBERG"))
-				dither = DITHER_FLOYDSTEINBERG;
-			else
-				fprintf(stderr, "Invalid dither mode: %s\n", v);
-		}
-	}
-	{
-		const char *v = getenv("S2TC_COLORDIST_MODE");
-		if(v)
-		{
-			if(!strcasecmp(v, "RGB"))
-				cd = RGB;
-			else if(!strcasecmp(v, "YUV"))
-				cd = YUV;
-			else if(!strcasecmp(v, "SRGB"))
-				cd = SRGB;
-			else if(!strcasecmp(v, "SRGB_MIXED"))
-				cd = SRGB_MIXED;
-			else if(!strcasecmp(v, "AVG"))
-				cd = AVG;
-			else if(!strcasecmp(v, "WAVG"))
-				cd = WAVG;
-			else if(!strcasecmp(v, "W0AVG"))
-				cd = W0AVG;
-			else if(!strcasecmp(v, "NORMALMAP"))
-				cd = NORMALMAP;
-			else
-				fprintf(stderr, "Invalid color dist mode: %s\n", v);
-		}
-	}
-	{
-		const char *v = getenv("S2TC_RANDOM_COLORS");
-		if(v)
-			nrandom = atoi(v);
+		default_context = s2tc_context_create(NULL);
 	}
+
+	// joins the worker threads before the library is unloaded
+#ifdef __GNUC__
+	__attribute__((destructor))
+#endif
+	void default_context_destroy()
 	{
-		const char *v = getenv("S2TC_REFINE_COLORS");
-		if(v)
-		{
-			if(!strcasecmp(v, "NEVER"))
-				refine = REFINE_NEVER;
-			else if(!strcasecmp(v, "ALWAYS"))
-				refine = REFINE_ALWAYS;
-			else if(!strcasecmp(v, "LOOP"))
-				refine = REFINE_LOOP;
-			else
-				fprintf(stderr, "Invalid refinement mode: %s\n", v);
-		}
+		s2tc_context_destroy(default_context);
+		default_context = NULL;
 	}
+};
 
+void tx_compress_dxtn(GLint srccomps, GLint width, GLint height,
+		      const GLubyte *srcPixData, GLenum destformat,
+		      GLubyte *dest, GLint dstRowStride)
+{
+	// compresses width*height pixels (L, LA, RGB or RGBA for srccomps 1 to 4) at srcPixData (packed) to destformat (dest, dstRowStride)
+
+	s2tc_format_t format;
 	switch (destformat) {
 		case GL_COMPRESSED_RGB_S3TC_DXT1_EXT:
 		case GL_COMPRESSED_RGBA_S3TC_DXT1_EXT:
-			dxt = DXT1;
-			rgb565_image(rgba, srcPixData, width, height, srccomps, 1, dither);
+			format = S2TC_FORMAT_DXT1;
 			break;
 		case GL_COMPRESSED_RGBA_S3TC_DXT3_EXT:
-			dxt = DXT3;
-			rgb565_image(rgba, srcPixData, width, height, srccomps, 4, dither);
+			format = S2TC_FORMAT_DXT3;
 			break;
 		case GL_COMPRESSED_RGBA_S3TC_DXT5_EXT:
-			dxt = DXT5;
-			rgb565_image(rgba, srcPixData, width, height, srccomps, 8, dither);
+			format = S2TC_FORMAT_DXT5;
 			break;
 		default:
-			free(rgba);
 			fprintf(stderr, "libdxtn: Bad dstFormat %d in tx_compress_dxtn\n", destformat);
 			return;
 	}
 
-	s2tc_encode_block_func_t encode_block = s2tc_encode_block_func(dxt, cd, nrandom, refine);
-	switch (destformat) {
-		case GL_COMPRESSED_RGB_S3TC_DXT1_EXT:
-		case GL_COMPRESSED_RGBA_S3TC_DXT1_EXT:
-			/* hmm we used to get called without dstRowStride... */
-			dstRowDiff = dstRowStride >= (width * 2) ? dstRowStride - (((width + 3) & ~3) * 2) : 0;
-			/*      fprintf(stderr, "dxt1 tex width %d tex height %d dstRowStride %d\n",
-				width, height, dstRowStride); */
-			for (j = 0; j < height; j += 4) {
-				if (height > j + 3) numypixels = 4;
-				else numypixels = height - j;
-				srcaddr = rgba + j * width * 4;
-				for (i = 0; i < width; i += 4) {
-					if (width > i + 3) numxpixels = 4;
-					else numxpixels = width - i;
-					encode_block(blkaddr, srcaddr, width, numxpixels, numypixels, nrandom);
-					srcaddr += 4 * numxpixels;
-					blkaddr += 8;
-				}
-				blkaddr += dstRowDiff;
-			}
-			break;
-		case GL_COMPRESSED_RGBA_S3TC_DXT3_EXT:
-			dstRowDiff = dstRowStride >= (width * 4) ? dstRowStride - (((width + 3) & ~3) * 4) : 0;
-			/*      fprintf(stderr, "dxt3 tex width %d tex height %d dstRowStride %d\n",
-				width, height, dstRowStride); */
-			for (j = 0; j < height; j += 4) {
-				if (height > j + 3) numypixels = 4;
-				else numypixels = height - j;
-				srcaddr = rgba + j * width * 4;
-				for (i = 0; i < width; i += 4) {
-					if (width > i + 3) numxpixels = 4;
-					else numxpixels = width - i;
-					encode_block(blkaddr, srcaddr, width, numxpixels, numypixels, nrandom);
-					srcaddr += 4 * numxpixels;
-					blkaddr += 16;
-				}
-				blkaddr += dstRowDiff;
-			}
-			break;
-		case GL_COMPRESSED_RGBA_S3TC_DXT5_EXT:
-			dstRowDiff = dstRowStride >= (width * 4) ? dstRowStride - (((width + 3) & ~3) * 4) : 0;
-			/*      fprintf(stderr, "dxt5 tex width %d tex height %d dstRowStride %d\n",
-				width, height, dstRowStride); */
-			for (j = 0; j < height; j += 4) {
-				if (height > j + 3) numypixels = 4;
-				else numypixels = height - j;
-				srcaddr = rgba + j * width * 4;
-				for (i = 0; i < width; i += 4) {
-					if (width > i + 3) numxpixels = 4;
-					else numxpixels = width - i;
-					encode_block(blkaddr, srcaddr, width, numxpixels, numypixels, nrandom);
-					srcaddr += 4 * numxpixels;
-					blkaddr += 16;
-				}
-				blkaddr += dstRowDiff;
-			}
-			break;
-	}
-
-	free(rgba);
+	pthread_once(&default_context_once, default_context_create);
+	if (!default_context || s2tc_compress(default_context, srccomps, width, height, srcPixData, format, dest, dstRowStride))
+		fprintf(stderr, "libdxtn: tx_compress_dxtn failed\n");
 }
@@ -0,0 +1,164 @@
+/*
+ * Copyright (C) 2011  Rudolf Polzer   All Rights Reserved.
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * RUDOLF POLZER BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN
+ * AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#define S2TC_LICENSE_IDENTIFIER s2tc_threadpool_license
+#include "s2tc_license.h"
+
+#include <stdlib.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "s2tc_threadpool.h"
+
+struct s2tc_threadpool_s
+{
+	pthread_mutex_t mutex;
+	pthread_cond_t wake;
+	pthread_cond_t done;
+	pthread_t *threads;
+	int nthreads;
+	bool quit;
+
+	// current run
+	unsigned int generation;
+	s2tc_threadpool_func_t func;
+	void *arg;
+	int n;
+	int next;
+	int busy;
+};
+
+namespace
+{
+	void s2tc_threadpool_work(s2tc_threadpool_t *pool, s2tc_threadpool_func_t func, void *arg, int n)
+	{
+		int i;
+		while((i = __sync_fetch_and_add(&pool->next, 1)) < n)
+			func(arg, i);
+	}
+
+	void *s2tc_threadpool_thread(void *p)
+	{
+		s2tc_threadpool_t *pool = (s2tc_threadpool_t *) p;
+		unsigned int seen = 0;
+		pthread_mutex_lock(&pool->mutex);
+		for(;;)
+		{
+			while(!pool->quit && pool->generation == seen)
+				pthread_cond_wait(&pool->wake, &pool->mutex);
+			if(pool->quit)
+				break;
+			seen = pool->generation;
+			s2tc_threadpool_func_t func = pool->func;
+			void *arg = pool->arg;
+			int n = pool->n;
+			pthread_mutex_unlock(&pool->mutex);
+			s2tc_threadpool_work(pool, func, arg, n);
+			pthread_mutex_lock(&pool->mutex);
+			if(--pool->busy == 0)
+				pthread_cond_signal(&pool->done);
+		}
+		pthread_mutex_unlock(&pool->mutex);
+		return NULL;
+	}
+};
+
+s2tc_threadpool_t *s2tc_threadpool_create(int nthreads)
+{
+	if(nthreads <= 0)
+	{
+		long n = sysconf(_SC_NPROCESSORS_ONLN);
+		nthreads = (n > 0) ? (int) n : 1;
+	}
+
+	s2tc_threadpool_t *pool = (s2tc_threadpool_t *) calloc(1, sizeof(*pool));
+	if(!pool)
+		return NULL;
+	pool->threads = (pthread_t *) calloc(nthreads, sizeof(*pool->threads));
+	if(!pool->threads)
+	{
+		free(pool);
+		return NULL;
+	}
+	pthread_mutex_init(&pool->mutex, NULL);
+	pthread_cond_init(&pool->wake, NULL);
+	pthread_cond_init(&pool->done, NULL);
+
+	// the calling thread is the first worker
+	pool->nthreads = 1;
+	while(pool->nthreads < nthreads)
+	{
+		if(pthread_create(&pool->threads[pool->nthreads], NULL, s2tc_threadpool_thread, pool))
+			break;
+		++pool->nthreads;
+	}
+	return pool;
+}
+
+void s2tc_threadpool_destroy(s2tc_threadpool_t *pool)
+{
+	int i;
+	if(!pool)
+		return;
+	pthread_mutex_lock(&pool->mutex);
+	pool->quit = true;
+	pthread_cond_broadcast(&pool->wake);
+	pthread_mutex_unlock(&pool->mutex);
+	for(i = 1; i < pool->nthreads; ++i)
+		pthread_join(pool->threads[i], NULL);
+	pthread_cond_destroy(&pool->done);
+	pthread_cond_destroy(&pool->wake);
+	pthread_mutex_destroy(&pool->mutex);
+	free(pool->threads);
+	free(pool);
+}
+
+int s2tc_threadpool_size(const s2tc_threadpool_t *pool)
+{
+	return pool ? pool->nthreads : 1;
+}
+
+void s2tc_threadpool_run(s2tc_threadpool_t *pool, s2tc_threadpool_func_t func, void *arg, int n)
+{
+	int i;
+	if(!pool || pool->nthreads <= 1 || n <= 1)
+	{
+		for(i = 0; i < n; ++i)
+			func(arg, i);
+		return;
+	}
+
+	pthread_mutex_lock(&pool->mutex);
+	pool->func = func;
+	pool->arg = arg;
+	pool->n = n;
+	pool->next = 0;
+	pool->busy = pool->nthreads - 1;
+	++pool->generation;
+	pthread_cond_broadcast(&pool->wake);
+	pthread_mutex_unlock(&pool->mutex);
+
+	s2tc_threadpool_work(pool, func, arg, n);
+
+	pthread_mutex_lock(&pool->mutex);
+	while(pool->busy > 0)
+		pthread_cond_wait(&pool->done, &pool->mutex);
+	pthread_mutex_unlock(&pool->mutex);
+}
@@ -0,0 +1,47 @@
+/*
+ * Copyright (C) 2011  Rudolf Polzer   All Rights Reserved.
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * RUDOLF POLZER BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN
+ * AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef S2TC_THREADPOOL_H
+#define S2TC_THREADPOOL_H
+
+// note: this is a C header file!
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct s2tc_threadpool_s s2tc_threadpool_t;
+
+// nthreads counts the calling thread; 0 means one per CPU
+s2tc_threadpool_t *s2tc_threadpool_create(int nthreads);
+void s2tc_threadpool_destroy(s2tc_threadpool_t *pool);
+int s2tc_threadpool_size(const s2tc_threadpool_t *pool);
+
+// calls func(arg, i) for every 0 <= i < n on the pool and the calling thread
+// returns when all calls are done; only one run at a time per pool
+typedef void (*s2tc_threadpool_func_t) (void *arg, int i);
+void s2tc_threadpool_run(s2tc_threadpool_t *pool, s2tc_threadpool_func_t func, void *arg, int n);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,199 @@
+/*
+ * Copyright (C) 2011  Rudolf Polzer   All Rights Reserved.
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * RUDOLF POLZER BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN
+ * AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#define S2TC_LICENSE_IDENTIFIER s2tc_transcode_license
+#include "s2tc_license.h"
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "s2tc.h"
+#include "s2tc_algorithm.h"
+
+// bit transforms from S3TC to S2TC blocks: the in-between palette entries
+// are mapped to one of the endpoints, without decoding any colors
+
+namespace
+{
+	inline uint32_t load32(const unsigned char *p)
+	{
+		return p[0] | (((uint32_t)p[1]) << 8) | (((uint32_t)p[2]) << 16) | (((uint32_t)p[3]) << 24);
+	}
+
+	inline void store32(unsigned char *p, uint32_t v)
+	{
+		p[0] = v & 0xFF;
+		p[1] = (v >> 8) & 0xFF;
+		p[2] = (v >> 16) & 0xFF;
+		p[3] = (v >> 24) & 0xFF;
+	}
+
+	inline uint64_t load64(const unsigned char *p)
+	{
+		return load32(p) | (((uint64_t)load32(p + 4)) << 32);
+	}
+
+	inline void store64(unsigned char *p, uint64_t v)
+	{
+		store32(p, v & 0xFFFFFFFF);
+		store32(p + 4, v >> 32);
+	}
+
+	// the conversions are branch-free: both cases are computed and one is
+	// picked by an all-ones/all-zero mask, so loops over many blocks vectorize
+
+	//pixels = (pixels & ~((~pixels & 0x55555555) << 1)) | ((pixels & 0x22882288) >> 1);
+	// 00 -> 00
+	// 01 -> 01
+	// 10 -> 00 or 01
+	// 11 -> 11
+
+	//pixels = (pixels & ((~pixels & 0xAAAAAAAA) >> 1)) | ((pixels & 0x22882288) >> 1);
+	// 00 -> 00
+	// 01 -> 01
+	// 10 -> 00 or 01
+	// 11 -> 00 or 01
+
+	inline void convert_dxt1(const unsigned char *in, unsigned char *out)
+	{
+		uint32_t colors = load32(in);
+		uint32_t pixels = load32(in + 4);
+		uint32_t c  = colors & 0xFFFF;
+		uint32_t c1 = colors >> 16;
+		uint32_t swap = -(uint32_t)(c1 >= c);
+
+		// we have no alpha, or 10, 11 "cannot be", but we better treat 11 the same way as 10 here
+		pixels = (pixels & ((~pixels & 0xAAAAAAAA) >> 1)) | ((pixels & 0x22882288) >> 1);
+		// alternatively: collapse
+		//pixels = pixels & 0x55555555;
+
+		// S2TC conformance: always use the same order of c, c1
+		// swap and invert
+		colors = (colors & ~swap) | (((colors >> 16) | (colors << 16)) & swap);
+		pixels ^= 0x55555555 & swap;
+
+		store32(out, colors);
+		store32(out + 4, pixels);
+	}
+
+	inline void convert_dxt1a(const unsigned char *in, unsigned char *out)
+	{
+		uint32_t colors = load32(in);
+		uint32_t pixels = load32(in + 4);
+		uint32_t c  = colors & 0xFFFF;
+		uint32_t c1 = colors >> 16;
+		uint32_t alpha = -(uint32_t)(c1 >= c);
+
+		// we have alpha, don't break it
+		uint32_t pa = (pixels & ~((~pixels & 0x55555555) << 1)) | ((pixels & 0x22882288) >> 1);
+
+		// we have no alpha
+		uint32_t pn = (pixels & ((~pixels & 0xAAAAAAAA) >> 1)) | ((pixels & 0x22882288) >> 1);
+		// alternatively: collapse
+		//pn = pixels & 0x55555555;
+
+		// S2TC conformance: always use the same order of c, c1
+		// swap and invert
+		pn ^= 0x55555555;
+		colors = (colors & alpha) | (((colors >> 16) | (colors << 16)) & ~alpha);
+
+		store32(out, colors);
+		store32(out + 4, (pa & alpha) | (pn & ~alpha));
+	}
+
+	inline void convert_dxt5(const unsigned char *in, unsigned char *out)
+	{
+		uint64_t block = load64(in);
+		uint64_t a  = block & 0xFF;
+		uint64_t a1 = (block >> 8) & 0xFF;
+		uint64_t pixels = block >> 16;
+		uint64_t ge = -(uint64_t)(a1 >= a);
+
+		// if a1 >= a, we want to map:
+		// 000 -> 000
+		// 001 -> 001
+		// 010 -> 000 or 001
+		// 011 -> 000 or 001
+		// 100 -> 001 or 000
+		// 101 -> 001 or 000
+		// 110 -> 110
+		// 111 -> 111
+		uint64_t x = (pixels >> 1) ^ (pixels >> 2);
+		uint64_t pge = (pixels & ~((x & 01111111111111111ull) * 7)) | (x & 00101101001011010ull);
+
+		// otherwise:
+		// 000 -> 000
+		// 001 -> 001
+		// 010 -> 000 or 001
+		// 011 -> 000 or 001
+		// 100 -> 000 or 001
+		// 101 -> 001 or 000
+		// 110 -> 001 or 000
+		// 111 -> 001 or 000
+		uint64_t o = (pixels >> 1) | (pixels >> 2);
+		uint64_t plt = (pixels & ~((o & 01111111111111111ull) * 7)) | (o & 00101101001011010ull);
+		// S2TC conformance: always use the same order of a, a1
+		// swap and invert
+		plt ^= 01111111111111111ull;
+		uint64_t alphas = (((a | (a1 << 8)) & ge) | ((a1 | (a << 8)) & ~ge));
+
+		store64(out, alphas | (((pge & ge) | (plt & ~ge)) << 16));
+	}
+
+	// converts n consecutive blocks from in to out
+	template<DxtMode dxt>
+	void convert_blocks(const unsigned char *in, unsigned char *out, size_t n)
+	{
+		const size_t blocksize = (dxt == DXT1) ? 8 : 16;
+		for(size_t i = 0; i < n; ++i, in += blocksize, out += blocksize)
+		{
+			if(dxt == DXT1)
+				convert_dxt1a(in, out);
+			else
+				convert_dxt1(in + 8, out + 8);
+			if(dxt == DXT3 && in != out)
+				memcpy(out, in, 8);
+			if(dxt == DXT5)
+				convert_dxt5(in, out);
+		}
+	}
+};
+
+int s2tc_transcode_from_s3tc(const unsigned char *src, unsigned char *dst, size_t nblocks, s2tc_format_t format)
+{
+	if(!src || !dst)
+		return -1;
+	switch(format)
+	{
+		case S2TC_FORMAT_DXT1:
+			convert_blocks<DXT1>(src, dst, nblocks);
+			break;
+		case S2TC_FORMAT_DXT3:
+			convert_blocks<DXT3>(src, dst, nblocks);
+			break;
+		case S2TC_FORMAT_DXT5:
+			convert_blocks<DXT5>(src, dst, nblocks);
+			break;
+		default:
+			return -1;
+	}
+	return 0;
+}
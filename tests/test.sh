@@ -14,7 +14,7 @@ make install
 cd tests
 
 rm -rf html
-rm -f *.dds
+rm -f *.dds *-alpha.tga
 mkdir html
 exec 3>html/index.html
 
@@ -82,6 +82,9 @@ EOF
 	fi
 	coltitle "faster_wavg_a"
 	coltitle "faster_wavg_l"
+	coltitle "realtime"
+	coltitle "realtime_dxt5"
+	coltitle "realtime_dxt1_alpha"
 
 	echo >&3 "</tr>"
 }
@@ -243,6 +246,14 @@ for i in dxtfail floor_tread01_norm fract001 base_concrete1a disabled lift02 sun
 	t "$i".tga "$i"-faster-wavg-r.dds bin/s2tc_compress -t $fourcc
 	S2TC_DITHER_MODE=SIMPLE         S2TC_COLORDIST_MODE=WAVG        S2TC_RANDOM_COLORS=-1 S2TC_REFINE_COLORS=LOOP \
 	t "$i".tga "$i"-faster-wavg-l.dds bin/s2tc_compress -t $fourcc
+	S2TC_COMPRESSION_MODE=REALTIME \
+	t "$i".tga "$i"-realtime.dds bin/s2tc_compress -t $fourcc
+	S2TC_COMPRESSION_MODE=REALTIME \
+	t "$i".tga "$i"-realtime-dxt5.dds bin/s2tc_compress -t DXT5
+	# a transparent hole, so DXT1 has to leave those pixels out of the colors
+	convert "$i".tga -alpha set -region 128x128+256+192 -channel A -evaluate set 0 +channel "$i"-alpha.tga
+	S2TC_COMPRESSION_MODE=REALTIME \
+	t "$i"-alpha.tga "$i"-realtime-alpha.dds bin/s2tc_compress -t DXT1
 
 	html_rowend
 done